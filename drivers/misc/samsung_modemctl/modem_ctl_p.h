@@ -31,6 +31,7 @@
 #define M_PIPE_MAX_HDR 16
 
 struct net_device;
+struct vnet_rx;
 
 struct m_pipe {
 	int (*push_header)(struct modem_io *io, void *header);
@@ -81,11 +82,19 @@ struct modemstats {
 	unsigned rx_dropped;
 	unsigned rx_purged;
 	unsigned rx_received;
+	unsigned rx_sched;
+	unsigned rx_coalesced;
+	unsigned rx_polls;
+	unsigned rx_poll_full;
+	unsigned rx_pool_empty;
 
 	unsigned tx_no_delay;
 	unsigned tx_queued;
 	unsigned tx_bp_signaled;
 	unsigned tx_fifo_full;
+	unsigned tx_dropped;
+	unsigned tx_stopped;
+	unsigned tx_woken;
 
 	unsigned pipe_tx;
 	unsigned pipe_rx;
@@ -122,6 +131,11 @@ struct modemctl {
 	struct wake_lock ip_rx_wakelock;
 
 	struct net_device **ndev;
+	struct vnet_rx *vnet_rx;
+
+	/* serializes writers of the raw tx fifo and the vnet txqs */
+	spinlock_t raw_tx_lock;
+	unsigned raw_tx_next;
 
 	int open_count;
 	int status;
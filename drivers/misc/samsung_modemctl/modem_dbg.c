@@ -60,11 +60,19 @@ static int stats_show(struct seq_file *sf, void *unused)
 	SHOW(rx_dropped);
 	SHOW(rx_purged);
 	SHOW(rx_received);
+	SHOW(rx_sched);
+	SHOW(rx_coalesced);
+	SHOW(rx_polls);
+	SHOW(rx_poll_full);
+	SHOW(rx_pool_empty);
 
 	SHOW(tx_no_delay);
 	SHOW(tx_queued);
 	SHOW(tx_bp_signaled);
 	SHOW(tx_fifo_full);
+	SHOW(tx_dropped);
+	SHOW(tx_stopped);
+	SHOW(tx_woken);
 
 	SHOW(pipe_tx);
 	SHOW(pipe_rx);
@@ -123,6 +123,23 @@ static unsigned fifo_skip(struct m_fifo *q, unsigned count)
 	return count;
 }
 
+/* Copy count bytes into the fifo at head, which the caller has checked
+ * there is space for, without publishing them.  Returns the new head.
+ */
+static unsigned fifo_put(struct m_fifo *q, unsigned head,
+			 const void *src, unsigned count)
+{
+	unsigned n = q->size - head;
+
+	if (likely(n >= count)) {
+		memcpy(q->data + head, src, count);
+	} else {
+		memcpy(q->data + head, src, n);
+		memcpy(q->data, src + n, count - n);
+	}
+	return (head + count) & (q->size - 1);
+}
+
 #define fifo_read(q, dst, count) \
 	_fifo_read(q, dst, count, memcpy)
 #define fifo_read_user(q, dst, count) \
@@ -313,39 +330,102 @@ struct vnet {
 	int rmnet_ch_id;
 };
 
-static void handle_raw_rx(struct modemctl *mc)
+/* The raw rx fifo is shared by all vnets, so a single NAPI context,
+ * hosted by a dummy netdev, drains it for all of them.  Once the
+ * mailbox interrupt finds packets in the fifo, the poll holds an mmio
+ * reference until the fifo is empty: the modem cannot add to it
+ * meanwhile, and whatever it queues up is picked up by one interrupt
+ * and one batch of polls.
+ */
+#define VNET_RX_WEIGHT	64
+#define VNET_RX_POOL	64
+#define VNET_RX_BUF	(ETH_DATA_LEN + NET_IP_ALIGN)
+
+struct vnet_rx {
+	struct net_device dev;
+	struct napi_struct napi;
+	struct modemctl *mc;
+
+	/* skbs for the next packets, only touched by vnet_poll() */
+	struct sk_buff_head pool;
+
+	/* the poll holds an mmio reference, protected by mc->lock */
+	unsigned held;
+};
+
+static void vnet_rx_refill(struct vnet_rx *rx, gfp_t gfp)
+{
+	struct sk_buff *skb;
+
+	while (skb_queue_len(&rx->pool) < VNET_RX_POOL) {
+		skb = __dev_alloc_skb(VNET_RX_BUF, gfp);
+		if (!skb)
+			break;
+		skb_reserve(skb, NET_IP_ALIGN);
+		__skb_queue_tail(&rx->pool, skb);
+	}
+}
+
+static struct sk_buff *vnet_rx_skb(struct vnet_rx *rx, unsigned sz,
+				   unsigned *pool_empty)
+{
+	struct sk_buff *skb;
+
+	if (likely(sz <= VNET_RX_BUF - NET_IP_ALIGN)) {
+		skb = __skb_dequeue(&rx->pool);
+		if (likely(skb))
+			return skb;
+		(*pool_empty)++;
+	}
+
+	skb = dev_alloc_skb(sz + NET_IP_ALIGN);
+	if (skb)
+		skb_reserve(skb, NET_IP_ALIGN);
+	return skb;
+}
+
+/* Called from vnet_poll() with an mmio reference held.  Returns the
+ * number of packets taken from the fifo, at most budget.
+ */
+static int handle_raw_rx(struct modemctl *mc, int budget)
 {
+	struct vnet_rx *rx = mc->vnet_rx;
 	struct raw_hdr raw;
 	struct sk_buff *skb = NULL;
-	int recvdata = 0;
+	unsigned received = 0, dropped = 0, unknown = 0, pool_empty = 0;
+	unsigned purged = 0;
+	unsigned long flags;
+	int work = 0;
 
 	/* process inbound packets */
-	while (fifo_read(&mc->raw_rx, &raw, sizeof(raw)) == sizeof(raw)) {
+	while (work < budget &&
+	       fifo_read(&mc->raw_rx, &raw, sizeof(raw)) == sizeof(raw)) {
 		struct net_device *dev;
 		unsigned sz = raw.len - (sizeof(raw) - 1);
 
+		work++;
 		if (unlikely(!(raw.channel >= RAW_CH_VNET0 && raw.channel <
 				NETDEV_TO_CHANNEL_ID(mc->num_pdp_contexts)))) {
 
-			MODEM_COUNT(mc, rx_unknown);
+			unknown++;
 			pr_err("[VNET] unknown channel %d\n", raw.channel);
 			if (fifo_skip(&mc->raw_rx, sz + 1) != (sz + 1))
 				goto purge_raw_fifo;
 			continue;
 		}
 		dev = mc->ndev[CHANNEL_TO_NETDEV_ID(raw.channel)];
-		skb = dev_alloc_skb(sz + NET_IP_ALIGN);
+		skb = vnet_rx_skb(rx, sz, &pool_empty);
 		if (skb == NULL) {
-			MODEM_COUNT(mc, rx_dropped);
-			/* TODO: consider timer + retry instead of drop? */
+			dropped++;
+			dev->stats.rx_dropped++;
 			pr_err("[VNET] cannot alloc %d byte packet\n", sz);
 			if (fifo_skip(&mc->raw_rx, sz + 1) != (sz + 1))
 				goto purge_raw_fifo;
 			continue;
 		}
 		skb->dev = dev;
-		skb_reserve(skb, NET_IP_ALIGN);
 
+		/* the only copy: from onedram straight into the skb */
 		if (fifo_read(&mc->raw_rx, skb_put(skb, sz), sz) != sz)
 			goto purge_raw_fifo;
 		if (fifo_skip(&mc->raw_rx, 1) != 1)
@@ -361,79 +441,240 @@ static void handle_raw_rx(struct modemctl *mc)
 		dev->stats.rx_packets++;
 		dev->stats.rx_bytes += skb->len;
 
-		netif_rx(skb);
-		recvdata = 1;
-		MODEM_COUNT(mc, rx_received);
+		netif_receive_skb(skb);
+		skb = NULL;
+		received++;
 	}
-
-	if (recvdata)
-		wake_lock_timeout(&mc->ip_rx_wakelock, HZ * 2);
-	return;
+	goto out;
 
 purge_raw_fifo:
 	if (skb)
-		dev_kfree_skb_irq(skb);
+		dev_kfree_skb(skb);
 	pr_err("[VNET] purging raw rx fifo!\n");
-	fifo_purge(&mc->raw_tx);
-	MODEM_COUNT(mc, rx_purged);
+	fifo_purge(&mc->raw_rx);
+	purged = 1;
+
+out:
+	spin_lock_irqsave(&mc->lock, flags);
+	mc->stats.rx_received += received;
+	mc->stats.rx_dropped += dropped;
+	mc->stats.rx_unknown += unknown;
+	mc->stats.rx_pool_empty += pool_empty;
+	mc->stats.rx_purged += purged;
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	if (received)
+		wake_lock_timeout(&mc->ip_rx_wakelock, HZ * 2);
+	return work;
 }
 
-int handle_raw_tx(struct modemctl *mc, struct sk_buff *skb)
+/* Packets wait on a queue per vnet for the fifo to take them.  These
+ * queues are kept short: when one fills up, the netdev queue is stopped
+ * and the qdisc above, which can tell bulk traffic from voice, holds
+ * on to the packets until the fifo has drained it again.
+ */
+#define VNET_TXQ_LEN	32
+#define VNET_TXQ_WAKE	(VNET_TXQ_LEN / 2)
+
+static int vnet_tx_pending(struct modemctl *mc)
 {
-	struct raw_hdr raw;
-	unsigned char ftr = 0x7e;
-	unsigned sz;
-	int netdev_id;
-	struct vnet *vn = netdev_priv(skb->dev);
+	struct vnet *vn;
+	int i;
 
+	for (i = 0; i < mc->num_pdp_contexts; i++) {
+		vn = netdev_priv(mc->ndev[i]);
+		if (!skb_queue_empty(&vn->txq))
+			return 1;
+	}
+	return 0;
+}
 
-	sz = skb->len + sizeof(raw) + 1;
+/* Raw tx frames are built straight from the skb, fragments included,
+ * and become visible to the modem with a single update of the fifo
+ * head.  Checksums left to us are computed while copying whenever the
+ * frame does not wrap around the end of the fifo.
+ *
+ * Returns 0 once the frame is in the fifo, -ENOSPC if it does not fit
+ * and another error if the packet must be dropped.
+ */
+static int handle_raw_tx(struct modemctl *mc, struct sk_buff *skb)
+{
+	struct m_fifo *q = &mc->raw_tx;
+	struct vnet *vn = netdev_priv(skb->dev);
+	struct raw_hdr raw;
+	unsigned char ftr = 0x7e;
+	unsigned head = *q->head;
+	unsigned len = skb->len;
+	unsigned n;
 
-	if (fifo_space(&mc->raw_tx) < sz) {
-		MODEM_COUNT(mc, tx_fifo_full);
-		return -1;
-	}
+	if (fifo_space(q) < len + sizeof(raw) + 1)
+		return -ENOSPC;
 
 	raw.start = 0x7f;
-	raw.len = 6 + skb->len;
+	raw.len = 6 + len;
 	raw.channel = vn->rmnet_ch_id;
 	raw.control = 0;
 
-	fifo_write(&mc->raw_tx, &raw, sizeof(raw));
-	fifo_write(&mc->raw_tx, skb->data, skb->len);
-	fifo_write(&mc->raw_tx, &ftr, 1);
+	head = fifo_put(q, head, &raw, sizeof(raw));
 
-	netdev_id = CHANNEL_TO_NETDEV_ID(vn->rmnet_ch_id);
-	mc->ndev[netdev_id]->stats.tx_packets++;
-	mc->ndev[netdev_id]->stats.tx_bytes += skb->len;
+	n = q->size - head;
+	if (likely(n >= len)) {
+		if (skb->ip_summed == CHECKSUM_PARTIAL)
+			skb_copy_and_csum_dev(skb, q->data + head);
+		else
+			skb_copy_bits(skb, 0, q->data + head, len);
+	} else {
+		if (skb->ip_summed == CHECKSUM_PARTIAL &&
+		    skb_checksum_help(skb))
+			return -EINVAL;
+		skb_copy_bits(skb, 0, q->data + head, n);
+		skb_copy_bits(skb, n, q->data, len - n);
+	}
+	head = (head + len) & (q->size - 1);
 
-	mc->mmio_signal_bits |= MBD_SEND_RAW;
+	head = fifo_put(q, head, &ftr, 1);
+	*q->head = head;
 
-	dev_kfree_skb_irq(skb);
 	return 0;
 }
 
-void modem_handle_io(struct modemctl *mc)
+/* Move queued packets into the raw tx fifo, one packet per vnet in
+ * turn, so that a bulk transfer on one PDP context cannot hold up the
+ * others, until the queues are empty or the fifo is full.  Must be
+ * called with an mmio reference held.  Returns the packets sent.
+ */
+static int vnet_tx(struct modemctl *mc)
 {
+	struct sk_buff_head done;
 	struct sk_buff *skb;
 	struct vnet *vn;
-	int i;
-	int  cnt = 0;
+	unsigned fifo_full = 0, dropped = 0, woken = 0;
+	int sent = 0, busy;
+	int i, k, ret;
 
-	handle_raw_rx(mc);
+	__skb_queue_head_init(&done);
 
-	for (i = 0; i < mc->num_pdp_contexts; i++) {
-		vn = netdev_priv(mc->ndev[i]);
-		while ((skb = skb_dequeue(&vn->txq)))
-			if (handle_raw_tx(mc, skb)) {
-				skb_queue_head(&vn->txq, skb);
+	spin_lock_bh(&mc->raw_tx_lock);
+	do {
+		busy = 0;
+		for (k = 0; k < mc->num_pdp_contexts; k++) {
+			i = (mc->raw_tx_next + k) % mc->num_pdp_contexts;
+			vn = netdev_priv(mc->ndev[i]);
+			skb = skb_peek(&vn->txq);
+			if (!skb)
+				continue;
+
+			ret = handle_raw_tx(mc, skb);
+			if (ret == -ENOSPC) {
+				/* resume with this vnet next time */
+				fifo_full++;
+				mc->raw_tx_next = i;
+				busy = 0;
 				break;
 			}
-		if (skb == NULL)
-			cnt++;
-	}
-	if (cnt == mc->num_pdp_contexts)
+			__skb_unlink(skb, &vn->txq);
+			__skb_queue_tail(&done, skb);
+			if (ret) {
+				dropped++;
+				mc->ndev[i]->stats.tx_dropped++;
+			} else {
+				sent++;
+				mc->ndev[i]->stats.tx_packets++;
+				mc->ndev[i]->stats.tx_bytes += skb->len;
+			}
+			if (netif_queue_stopped(mc->ndev[i]) &&
+			    skb_queue_len(&vn->txq) <= VNET_TXQ_WAKE) {
+				netif_wake_queue(mc->ndev[i]);
+				woken++;
+			}
+			busy = 1;
+		}
+		/* the next round starts one vnet further on */
+		if (busy)
+			mc->raw_tx_next = (mc->raw_tx_next + 1) %
+					  mc->num_pdp_contexts;
+	} while (busy);
+
+	if (!vnet_tx_pending(mc))
 		wake_unlock(&mc->ip_tx_wakelock);
+	spin_unlock_bh(&mc->raw_tx_lock);
+
+	/* free what was sent outside of the lock */
+	while ((skb = __skb_dequeue(&done)))
+		dev_kfree_skb_any(skb);
+
+	if (fifo_full || dropped || woken) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&mc->lock, flags);
+		mc->stats.tx_fifo_full += fifo_full;
+		mc->stats.tx_dropped += dropped;
+		mc->stats.tx_woken += woken;
+		spin_unlock_irqrestore(&mc->lock, flags);
+	}
+
+	return sent;
+}
+
+static int vnet_poll(struct napi_struct *napi, int budget)
+{
+	struct vnet_rx *rx = container_of(napi, struct vnet_rx, napi);
+	struct modemctl *mc = rx->mc;
+	unsigned long flags;
+	int work, sent;
+
+	work = handle_raw_rx(mc, budget);
+	sent = vnet_tx(mc);
+	vnet_rx_refill(rx, GFP_ATOMIC);
+
+	spin_lock_irqsave(&mc->lock, flags);
+	MODEM_COUNT(mc, rx_polls);
+	if (work >= budget)
+		MODEM_COUNT(mc, rx_poll_full);
+	if (sent)
+		mc->mmio_signal_bits |= MBD_SEND_RAW;
+	spin_unlock_irqrestore(&mc->lock, flags);
+
+	if (work < budget) {
+		/* Complete before dropping the reference, so that an
+		 * interrupt after the release schedules a new poll.
+		 */
+		napi_complete(napi);
+		spin_lock_irqsave(&mc->lock, flags);
+		rx->held = 0;
+		spin_unlock_irqrestore(&mc->lock, flags);
+		modem_release_mmio(mc, 0);
+	}
+
+	return work;
+}
+
+/* Called with mc->lock held while we own the mmio hw semaphore */
+static void vnet_schedule(struct modemctl *mc)
+{
+	struct vnet_rx *rx = mc->vnet_rx;
+
+	if (rx->held) {
+		MODEM_COUNT(mc, rx_coalesced);
+		return;
+	}
+	if (fifo_count(&mc->raw_rx) == 0 && !vnet_tx_pending(mc))
+		return;
+
+	/* keep the semaphore until vnet_poll() has drained the fifos */
+	mc->mmio_req_count++;
+	mc->mmio_owner = 1;
+	rx->held = 1;
+	napi_schedule(&rx->napi);
+	MODEM_COUNT(mc, rx_sched);
+}
+
+/* Called from the mailbox interrupt; the io itself is done by
+ * vnet_poll() with interrupts enabled.
+ */
+void modem_handle_io(struct modemctl *mc)
+{
+	vnet_schedule(mc);
 }
 
 static int vnet_open(struct net_device *ndev)
@@ -453,32 +694,36 @@ static int vnet_xmit(struct sk_buff *skb, struct net_device *ndev)
 	struct vnet *vn = netdev_priv(ndev);
 	struct modemctl *mc = vn->mc;
 	unsigned long flags;
+	int stopped = 0, sent = 0, owner;
+
+	spin_lock_bh(&mc->raw_tx_lock);
+	__skb_queue_tail(&vn->txq, skb);
+	if (skb_queue_len(&vn->txq) >= VNET_TXQ_LEN) {
+		/* the fifo is not keeping up, push back on the stack */
+		netif_stop_queue(ndev);
+		stopped = 1;
+	}
+	wake_lock(&mc->ip_tx_wakelock);
+	spin_unlock_bh(&mc->raw_tx_lock);
+
+	/* If we happen to hold the hw mmio sem, transmit NOW.
+	 * Otherwise the modem has been asked for it, and vnet_poll()
+	 * transmits once it hands it over.
+	 */
+	owner = modem_request_mmio(mc);
+	if (owner)
+		sent = vnet_tx(mc);
+	modem_release_mmio(mc, sent ? MBD_SEND_RAW : 0);
 
 	spin_lock_irqsave(&mc->lock, flags);
-	if (readl(mc->mmio + OFF_SEM) & 1) {
-		/* if we happen to hold the hw mmio sem, transmit NOW */
-		if (handle_raw_tx(mc, skb)) {
-			wake_lock(&mc->ip_tx_wakelock);
-			skb_queue_tail(&vn->txq, skb);
-		} else {
-			MODEM_COUNT(mc, tx_no_delay);
-		}
-		if (!mc->mmio_owner) {
-			/* if we don't own the semaphore, immediately
-			 * give it back to the modem and signal the modem
-			 * to process the packet
-			 */
-			writel(0, mc->mmio + OFF_SEM);
-			writel(MB_VALID | MBD_SEND_RAW,
-			       mc->mmio + OFF_MBOX_AP);
-			MODEM_COUNT(mc, tx_bp_signaled);
-		}
-	} else {
-		/* otherwise request the hw mmio sem and queue */
-		modem_request_sem(mc);
-		skb_queue_tail(&vn->txq, skb);
+	if (sent) {
+		mc->stats.tx_no_delay += sent;
+		MODEM_COUNT(mc, tx_bp_signaled);
+	} else if (!owner) {
 		MODEM_COUNT(mc, tx_queued);
 	}
+	if (stopped)
+		MODEM_COUNT(mc, tx_stopped);
 	spin_unlock_irqrestore(&mc->lock, flags);
 
 	return NETDEV_TX_OK;
@@ -500,6 +745,7 @@ static void vnet_setup(struct net_device *ndev)
 	ndev->tx_queue_len = 1000;
 	ndev->mtu = ETH_DATA_LEN;
 	ndev->watchdog_timeo = 5 * HZ;
+	ndev->features = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_HIGHDMA;
 }
 
 struct fmt_hdr {
@@ -652,6 +898,26 @@ static int modem_pipe_register(struct m_pipe *pipe, const char *devname)
 	return misc_register(&pipe->dev);
 }
 
+static int vnet_rx_init(struct modemctl *mc)
+{
+	struct vnet_rx *rx;
+
+	rx = kzalloc(sizeof(*rx), GFP_KERNEL);
+	if (!rx)
+		return -ENOMEM;
+
+	rx->mc = mc;
+	skb_queue_head_init(&rx->pool);
+	vnet_rx_refill(rx, GFP_KERNEL);
+
+	init_dummy_netdev(&rx->dev);
+	netif_napi_add(&rx->dev, &rx->napi, vnet_poll, VNET_RX_WEIGHT);
+	napi_enable(&rx->napi);
+
+	mc->vnet_rx = rx;
+	return 0;
+}
+
 int modem_io_init(struct modemctl *mc, void __iomem *mmio)
 {
 	struct vnet *vn;
@@ -666,12 +932,19 @@ int modem_io_init(struct modemctl *mc, void __iomem *mmio)
 	INIT_M_FIFO(mc->rfs_tx, RFS, TX, mmio);
 	INIT_M_FIFO(mc->rfs_rx, RFS, RX, mmio);
 
+	spin_lock_init(&mc->raw_tx_lock);
+
 	mc->ndev = kmalloc(sizeof(struct net_device *) * mc->num_pdp_contexts,
 			 GFP_KERNEL);
 	if (!mc->ndev) {
 		pr_err("memory allocation failed for netdev\n");
 		return -ENOMEM;
 	}
+	if (vnet_rx_init(mc)) {
+		pr_err("memory allocation failed for vnet rx\n");
+		kfree(mc->ndev);
+		return -ENOMEM;
+	}
 	for (i = 0, ch_id = RAW_CH_VNET0; i < mc->num_pdp_contexts;
 			i++, ch_id++) {
 		mc->ndev[i] = alloc_netdev(0, "rmnet%d", vnet_setup);
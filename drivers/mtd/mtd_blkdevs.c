@@ -99,9 +99,14 @@ static int do_blktrans_request(struct mtd_blktrans_ops *tr,
 
 	switch(rq_data_dir(req)) {
 	case READ:
-		for (; nsect > 0; nsect--, block++, buf += tr->blksize)
-			if (tr->readsect(dev, block, buf))
+		if (tr->readsects) {
+			if (tr->readsects(dev, block, nsect, buf))
 				return -EIO;
+		} else {
+			for (; nsect > 0; nsect--, block++, buf += tr->blksize)
+				if (tr->readsect(dev, block, buf))
+					return -EIO;
+		}
 		rq_flush_dcache_pages(req);
 		return 0;
 	case WRITE:
@@ -263,6 +263,13 @@ static int mtdblock_readsect(struct mtd_blktrans_dev *dev,
 	return do_cached_read(mtdblk, block<<9, 512, buf);
 }
 
+static int mtdblock_readsects(struct mtd_blktrans_dev *dev,
+			      unsigned long block, unsigned nsect, char *buf)
+{
+	struct mtdblk_dev *mtdblk = container_of(dev, struct mtdblk_dev, mbd);
+	return do_cached_read(mtdblk, block<<9, nsect<<9, buf);
+}
+
 static int mtdblock_writesect(struct mtd_blktrans_dev *dev,
 			      unsigned long block, char *buf)
 {
@@ -381,6 +388,7 @@ static struct mtd_blktrans_ops mtdblock_tr = {
 	.flush		= mtdblock_flush,
 	.release	= mtdblock_release,
 	.readsect	= mtdblock_readsect,
+	.readsects	= mtdblock_readsects,
 	.writesect	= mtdblock_writesect,
 	.add_mtd	= mtdblock_add_mtd,
 	.remove_dev	= mtdblock_remove_dev,
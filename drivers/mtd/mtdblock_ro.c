@@ -34,6 +34,16 @@ static int mtdblock_readsect(struct mtd_blktrans_dev *dev,
 	return 0;
 }
 
+static int mtdblock_readsects(struct mtd_blktrans_dev *dev,
+			      unsigned long block, unsigned nsect, char *buf)
+{
+	size_t retlen;
+
+	if (dev->mtd->read(dev->mtd, (block * 512), nsect * 512, &retlen, buf))
+		return 1;
+	return retlen != nsect * 512;
+}
+
 static int mtdblock_writesect(struct mtd_blktrans_dev *dev,
 			      unsigned long block, char *buf)
 {
@@ -73,6 +83,7 @@ static struct mtd_blktrans_ops mtdblock_tr = {
 	.part_bits	= 0,
 	.blksize 	= 512,
 	.readsect	= mtdblock_readsect,
+	.readsects	= mtdblock_readsects,
 	.writesect	= mtdblock_writesect,
 	.add_mtd	= mtdblock_add_mtd,
 	.remove_dev	= mtdblock_remove_dev,
@@ -20,6 +20,9 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/vmalloc.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
 #include <linux/mtd/mtd.h>
 #include <linux/mtd/partitions.h>
 #include <linux/mtd/onenand.h>
@@ -61,10 +64,113 @@ static int boundary[] = {
 	CONFIG_FLEXONENAND_SIM_DIE0_BOUNDARY,
 	CONFIG_FLEXONENAND_SIM_DIE1_BOUNDARY,
 };
+static int pi_operation;
+
+/*
+ * Timing model. A command leaves the interrupt register clear until its
+ * latency has passed, so the driver polls or sleeps as it would on a real
+ * chip, and BufferRAM copies are charged at the speed of the host bus.
+ * The defaults are the worst cases of the OneNAND specification.
+ */
+static uint do_delays;
+module_param(do_delays, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(do_delays, "Simulate OneNAND latencies if not zero");
+
+static uint load_delay = 30;
+module_param(load_delay, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(load_delay, "Page load delay (microseconds)");
+
+static uint program_delay = 350;
+module_param(program_delay, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(program_delay, "Page program delay (microseconds)");
+
+static uint erase_delay = 2000;
+module_param(erase_delay, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(erase_delay, "Block erase delay (microseconds)");
+
+static uint bufferram_delay = 8000;
+module_param(bufferram_delay, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(bufferram_delay, "BufferRAM transfer delay per KiB "
+		 "(nanoseconds)");
+
+/*
+ * Fault injection. Bad blocks carry a bad block marker whenever their
+ * first two pages are loaded, failing blocks report a controller error
+ * on program and erase and are left untouched, and every Nth page load
+ * reports a corrected or an uncorrectable ECC error. The schedule is
+ * deterministic so that a failing run can be repeated.
+ */
+#define MAX_INJECT_BLOCKS	32
+
+static int badblocks[MAX_INJECT_BLOCKS];
+static int nr_badblocks;
+module_param_array(badblocks, int, &nr_badblocks, S_IRUGO);
+MODULE_PARM_DESC(badblocks, "Blocks which are marked bad");
+
+static int failblocks[MAX_INJECT_BLOCKS];
+static int nr_failblocks;
+module_param_array(failblocks, int, &nr_failblocks, S_IRUGO);
+MODULE_PARM_DESC(failblocks, "Blocks which fail to program and erase");
+
+static uint bitflip_every;
+module_param(bitflip_every, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(bitflip_every, "Report a corrected bit flip every N page "
+		 "loads (0 = never)");
+
+static uint eccerr_every;
+module_param(eccerr_every, uint, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(eccerr_every, "Report an uncorrectable ECC error every N "
+		 "page loads (0 = never)");
+
+static struct onenand_sim_stats {
+	unsigned long	loads;
+	unsigned long	programs;
+	unsigned long	erases;
+	u64		load_ns;	/* modelled busy time per operation */
+	u64		program_ns;
+	u64		erase_ns;
+	u64		read_bytes;	/* BufferRAM transfers */
+	u64		write_bytes;
+	u64		xfer_ns;
+	unsigned long	polls;		/* interrupt reads while busy */
+	unsigned long	overruns;	/* commands issued while busy */
+	unsigned long	bad_loads;
+	unsigned long	failed;
+	unsigned long	bitflips;
+	unsigned long	eccerrs;
+} sim_stats;
+
+static int onenand_sim_get_stats(char *buffer, const struct kernel_param *kp)
+{
+	return scnprintf(buffer, PAGE_SIZE,
+			 "load %lu %llu\nprogram %lu %llu\nerase %lu %llu\n"
+			 "read_bytes %llu\nwrite_bytes %llu\nxfer_ns %llu\n"
+			 "polls %lu\noverruns %lu\nbad_loads %lu\n"
+			 "failed %lu\nbitflips %lu\neccerrs %lu\n",
+			 sim_stats.loads, sim_stats.load_ns,
+			 sim_stats.programs, sim_stats.program_ns,
+			 sim_stats.erases, sim_stats.erase_ns,
+			 sim_stats.read_bytes, sim_stats.write_bytes,
+			 sim_stats.xfer_ns, sim_stats.polls,
+			 sim_stats.overruns, sim_stats.bad_loads,
+			 sim_stats.failed, sim_stats.bitflips,
+			 sim_stats.eccerrs);
+}
+
+/* Writing anything to the parameter starts a new measurement */
+static int onenand_sim_reset_stats(const char *val, struct kernel_param *kp)
+{
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	return 0;
+}
+module_param_call(stats, onenand_sim_reset_stats, onenand_sim_get_stats,
+		  NULL, S_IWUSR | S_IRUGO);
 
 struct onenand_flash {
 	void __iomem *base;
 	void __iomem *data;
+	unsigned int busy_interrupt;	/* interrupt once the chip is ready */
+	u64 ready_at;			/* local_clock() when it is ready */
 };
 
 #define ONENAND_CORE(flash)		(flash->data)
@@ -194,21 +300,32 @@ static void onenand_bootram_handle(struct onenand_chip *this, int cmd)
  */
 static void onenand_update_interrupt(struct onenand_chip *this, int cmd)
 {
+	struct onenand_flash *flash = this->priv;
 	int interrupt = ONENAND_INT_MASTER;
+	u64 delay = 0;
 
 	switch (cmd) {
 	case ONENAND_CMD_READ:
 	case ONENAND_CMD_READOOB:
 		interrupt |= ONENAND_INT_READ;
+		sim_stats.loads++;
+		delay = (u64) load_delay * NSEC_PER_USEC;
+		sim_stats.load_ns += do_delays ? delay : 0;
 		break;
 
 	case ONENAND_CMD_PROG:
 	case ONENAND_CMD_PROGOOB:
 		interrupt |= ONENAND_INT_WRITE;
+		sim_stats.programs++;
+		delay = (u64) program_delay * NSEC_PER_USEC;
+		sim_stats.program_ns += do_delays ? delay : 0;
 		break;
 
 	case ONENAND_CMD_ERASE:
 		interrupt |= ONENAND_INT_ERASE;
+		sim_stats.erases++;
+		delay = (u64) erase_delay * NSEC_PER_USEC;
+		sim_stats.erase_ns += do_delays ? delay : 0;
 		break;
 
 	case ONENAND_CMD_RESET:
@@ -219,9 +336,76 @@ static void onenand_update_interrupt(struct onenand_chip *this, int cmd)
 		break;
 	}
 
+	/* The chip stays busy until onenand_readw() sees the time is up */
+	if (do_delays && delay) {
+		flash->busy_interrupt = interrupt;
+		flash->ready_at = local_clock() + delay;
+		interrupt = 0;
+	} else
+		flash->busy_interrupt = 0;
+
 	writew(interrupt, this->base + ONENAND_REG_INTERRUPT);
 }
 
+static int onenand_block_listed(int *blocks, int nr, int block)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (blocks[i] == block)
+			return 1;
+	return 0;
+}
+
+/**
+ * onenand_inject_load - Inject faults into a page load
+ * @this:		OneNAND device structure
+ * @cmd:		The command to be sent
+ * @block:		The block loaded
+ * @page:		The page loaded
+ * @dataram:		Which dataram used
+ *
+ * Overwrite the bad block marker of listed bad blocks and set the ECC
+ * status as the bit flip schedule says.
+ */
+static void onenand_inject_load(struct onenand_chip *this, int cmd,
+				int block, int page, int dataram)
+{
+	struct mtd_info *mtd = &info->mtd;
+	static unsigned int nr_loads;
+	void __iomem *data = ONENAND_MAIN_AREA(this, 0);
+	void __iomem *spare = ONENAND_SPARE_AREA(this, 0);
+	int ecc = 0;
+
+	if (dataram) {
+		data += mtd->writesize;
+		spare += mtd->oobsize;
+	}
+
+	if (page < 2 && onenand_block_listed(badblocks, nr_badblocks, block)) {
+		writew(0x0000, spare + ONENAND_BADBLOCK_POS);
+		sim_stats.bad_loads++;
+	}
+
+	if (cmd == ONENAND_CMD_READ) {
+		nr_loads++;
+		if (eccerr_every && !(nr_loads % eccerr_every)) {
+			/* Hand the uncorrected data on, too */
+			writeb(readb(data) ^ 0x01, data);
+			if (FLEXONENAND(this) || ONENAND_IS_4KB_PAGE(this))
+				ecc = FLEXONENAND_UNCORRECTABLE_ERROR;
+			else
+				ecc = ONENAND_ECC_2BIT_ALL;
+			sim_stats.eccerrs++;
+		} else if (bitflip_every && !(nr_loads % bitflip_every)) {
+			ecc = ONENAND_ECC_1BIT;
+			sim_stats.bitflips++;
+		}
+	}
+
+	writew(ecc, this->base + ONENAND_REG_ECC_STATUS);
+}
+
 /**
  * onenand_check_overwrite - Check if over-write happened
  * @dest:		The destination pointer
@@ -266,7 +450,6 @@ static void onenand_data_handle(struct onenand_chip *this, int cmd,
 	void __iomem *src;
 	void __iomem *dest;
 	unsigned int i;
-	static int pi_operation;
 	int erasesize, rgn;
 
 	if (dataram) {
@@ -370,8 +553,12 @@ static void onenand_data_handle(struct onenand_chip *this, int cmd,
 static void onenand_command_handle(struct onenand_chip *this, int cmd)
 {
 	unsigned long offset = 0;
+	struct onenand_flash *flash = this->priv;
 	int block = -1, page = -1, bufferram = -1;
-	int dataram = 0;
+	int dataram = 0, ctrl = 0;
+
+	if (flash->busy_interrupt && local_clock() < flash->ready_at)
+		sim_stats.overruns++;
 
 	switch (cmd) {
 	case ONENAND_CMD_UNLOCK:
@@ -410,11 +597,129 @@ static void onenand_command_handle(struct onenand_chip *this, int cmd)
 	if (page != -1)
 		offset += page << this->page_shift;
 
-	onenand_data_handle(this, cmd, dataram, offset);
+	switch (cmd) {
+	case ONENAND_CMD_PROG:
+	case ONENAND_CMD_PROGOOB:
+	case ONENAND_CMD_ERASE:
+		if (!pi_operation &&
+		    onenand_block_listed(failblocks, nr_failblocks, block)) {
+			ctrl = ONENAND_CTRL_ERROR;
+			sim_stats.failed++;
+		}
+		break;
+	}
+
+	if (!ctrl)
+		onenand_data_handle(this, cmd, dataram, offset);
 
+	if ((cmd == ONENAND_CMD_READ || cmd == ONENAND_CMD_READOOB) &&
+	    !pi_operation)
+		onenand_inject_load(this, cmd, block, page, dataram);
+
+	writew(ctrl, this->base + ONENAND_REG_CTRL_STATUS);
 	onenand_update_interrupt(this, cmd);
 }
 
+/**
+ * onenand_readw - [OneNAND Interface] Emulate read operation
+ * @addr:		address to read
+ *
+ * Read OneNAND register. The interrupt register reads as clear for as
+ * long as the last command keeps the chip busy.
+ */
+static unsigned short onenand_readw(void __iomem *addr)
+{
+	struct onenand_chip *this = info->mtd.priv;
+	struct onenand_flash *flash = this->priv;
+
+	if (addr == this->base + ONENAND_REG_INTERRUPT &&
+	    flash->busy_interrupt) {
+		if (local_clock() < flash->ready_at) {
+			sim_stats.polls++;
+			return 0;
+		}
+		writew(flash->busy_interrupt, addr);
+		flash->busy_interrupt = 0;
+	}
+
+	return readw(addr);
+}
+
+/* Spend as long as the host bus would need to move @count bytes */
+static void onenand_bufferram_delay(size_t count)
+{
+	u64 ns;
+	u32 rem;
+
+	if (!do_delays || !bufferram_delay)
+		return;
+
+	ns = ((u64) count * bufferram_delay) >> 10;
+	sim_stats.xfer_ns += ns;
+	rem = do_div(ns, NSEC_PER_USEC);
+	if (ns)
+		udelay(ns);
+	ndelay(rem);
+}
+
+static void __iomem *onenand_bufferram(struct mtd_info *mtd, int area)
+{
+	struct onenand_chip *this = mtd->priv;
+	void __iomem *bufferram = this->base + area;
+
+	if (ONENAND_CURRENT_BUFFERRAM(this)) {
+		/* Note: the 'this->writesize' is a real page size */
+		if (area == ONENAND_DATARAM)
+			bufferram += this->writesize;
+		if (area == ONENAND_SPARERAM)
+			bufferram += mtd->oobsize;
+	}
+
+	return bufferram;
+}
+
+/**
+ * onenand_read_bufferram - [OneNAND Interface] Emulate BufferRAM read
+ * @mtd:		MTD data structure
+ * @area:		BufferRAM area
+ * @buffer:		the databuffer to put data
+ * @offset:		offset to read from
+ * @count:		number of bytes to read
+ *
+ * Read the BufferRAM area at the simulated bus speed
+ */
+static int onenand_read_bufferram(struct mtd_info *mtd, int area,
+		unsigned char *buffer, int offset, size_t count)
+{
+	memcpy(buffer, onenand_bufferram(mtd, area) + offset, count);
+
+	sim_stats.read_bytes += count;
+	onenand_bufferram_delay(count);
+
+	return 0;
+}
+
+/**
+ * onenand_write_bufferram - [OneNAND Interface] Emulate BufferRAM write
+ * @mtd:		MTD data structure
+ * @area:		BufferRAM area
+ * @buffer:		the databuffer to get data
+ * @offset:		offset to write to
+ * @count:		number of bytes to write
+ *
+ * Write the BufferRAM area at the simulated bus speed
+ */
+static int onenand_write_bufferram(struct mtd_info *mtd, int area,
+		const unsigned char *buffer, int offset, size_t count)
+{
+	memcpy(onenand_bufferram(mtd, area) + offset, buffer, count);
+
+	sim_stats.write_bytes += count;
+	onenand_bufferram_delay(count);
+
+	return 0;
+}
+
 /**
  * onenand_writew - [OneNAND Interface] Emulate write operation
  * @value:		value to write
@@ -513,8 +818,11 @@ static int __init onenand_sim_init(void)
 		return -ENOMEM;
 	}
 
-	/* Override write_word function */
+	/* Override register and BufferRAM access functions */
+	info->onenand.read_word = onenand_readw;
 	info->onenand.write_word = onenand_writew;
+	info->onenand.read_bufferram = onenand_read_bufferram;
+	info->onenand.write_bufferram = onenand_write_bufferram;
 
 	if (flash_init(&info->flash)) {
 		printk(KERN_ERR "Unable to allocate flash.\n");
@@ -42,6 +42,7 @@
 #include <linux/mtd/partitions.h>
 #include <linux/clk.h>
 #include <linux/dma-mapping.h>
+#include <linux/ratelimit.h>
 
 #include <asm/io.h>
 #include <asm/cacheflush.h>
@@ -105,6 +106,26 @@ static void __iomem * onenandctl_vbase = NULL;
 #define DMA_IN2OUT			0
 #define DMA_OUT2IN			1
 
+/* Interrupt controller of the OneNAND controller, behind IRQ_ONENAND_AUDI */
+#define CTRL_INTC_DMA_CLR_OFFSET	0x1004
+#define CTRL_INTC_ONENAND_CLR_OFFSET	0x1008
+#define CTRL_INTC_DMA_MASK_OFFSET	0x1024
+#define CTRL_INTC_ONENAND_MASK_OFFSET	0x1028
+#define CTRL_INTC_DMA_STATUS_OFFSET	0x1064
+#define CTRL_INTC_ONENAND_STATUS_OFFSET	0x1068
+
+#define INTC_DMA_TD			(1<<24)
+#define INTC_DMA_TE			(1<<16)
+#define INTC_DMA_ALL			(INTC_DMA_TD | INTC_DMA_TE)
+
+/*
+ * There's no DMA timeout in the Spec. A page takes well under 1 msec,
+ * so 20 msecs are enough. Polled transfers count 1 usec steps instead
+ * of jiffies, which don't move in a panic.
+ */
+#define DMA_TIMEOUT_MS			20
+#define DMA_POLL_STEPS			(DMA_TIMEOUT_MS * 1000)
+
 #ifdef CONFIG_MTD_CMDLINE_PARTS
 static const char *part_probes[] = { "cmdlinepart", NULL };
 #endif
@@ -115,6 +136,10 @@ struct onenand_info {
 	struct onenand_chip	onenand;
 	struct resource		*base_res;
 	struct resource		*ctl_res;
+	int			irq;
+	int			dma_masked;	/* -1: unknown */
+	u32			dma_status;
+	struct completion	dma_done;
 };
 
 
@@ -135,6 +160,42 @@ MODULE_PARM_DESC(flex_bdry,	"SLC Boundary information for Flex-OneNAND"
 				"    : 0->Set boundary in unlocked status"
 				"    : 1->Set boundary in locked status");
 
+/* Shorter transfers are polled, waking up for them costs more than it saves */
+static int dma_irq_min = 512;
+module_param(dma_irq_min, int, S_IWUSR | S_IRUGO);
+MODULE_PARM_DESC(dma_irq_min, "Smallest DMA transfer, in bytes, to wait for "
+				"by interrupt");
+
+static struct {
+	unsigned long	dma_irq;	/* DMA completed by interrupt */
+	unsigned long	dma_poll;	/* DMA polled */
+	unsigned long	dma_lost_irq;	/* DMA done, its interrupt never came */
+	unsigned long	dma_failed;	/* DMA error or timeout, CPU copied */
+	unsigned long	dma_timeout;	/* DMA never ended, aborted */
+	unsigned long	wait_irq;	/* command completed by interrupt */
+	unsigned long	wait_timeout;	/* no interrupt, polled the chip */
+	unsigned long	read_single;	/* reads of one page */
+	unsigned long	read_overlap;	/* reads of more, loads overlapped */
+	unsigned long	read_overlap_pages; /* pages loaded during a transfer */
+} onenand_stats;
+
+static int onenand_get_stats(char *buffer, const struct kernel_param *kp)
+{
+	return scnprintf(buffer, PAGE_SIZE,
+			 "dma_irq %lu\ndma_poll %lu\ndma_lost_irq %lu\n"
+			 "dma_failed %lu\ndma_timeout %lu\n"
+			 "wait_irq %lu\nwait_timeout %lu\n"
+			 "read_single %lu\nread_overlap %lu\n"
+			 "read_overlap_pages %lu\n",
+			 onenand_stats.dma_irq, onenand_stats.dma_poll,
+			 onenand_stats.dma_lost_irq, onenand_stats.dma_failed,
+			 onenand_stats.dma_timeout,
+			 onenand_stats.wait_irq, onenand_stats.wait_timeout,
+			 onenand_stats.read_single, onenand_stats.read_overlap,
+			 onenand_stats.read_overlap_pages);
+}
+module_param_call(stats, NULL, onenand_get_stats, NULL, S_IRUGO);
+
 #ifdef ONENAND_CLOCK_GATING
 static struct clk *onenand_clk;
 #endif
@@ -592,6 +653,9 @@ static int onenand_command(struct mtd_info *mtd, int cmd, loff_t addr, size_t le
 		this->write_word(value, this->base + ONENAND_REG_START_BUFFER);
 	}
 
+	/* Whatever completed before belongs to an earlier command */
+	INIT_COMPLETION(this->complete);
+
 	/* Interrupt clear */
 	this->write_word(ONENAND_INT_CLEAR, this->base + ONENAND_REG_INTERRUPT);
 
@@ -694,17 +758,80 @@ static int onenand_wait(struct mtd_info *mtd, int state)
  * @param irq		onenand interrupt number
  * @param dev_id	interrupt data
  *
- * complete the work
+ * The controller has one interrupt for both its DMA engine and the INT
+ * pin of the chip. Acknowledge whichever fired and complete its wait.
  */
 static irqreturn_t onenand_interrupt(int irq, void *data)
 {
-	struct onenand_chip *this = data;
+	struct onenand_info *info = data;
+	struct onenand_chip *this = &info->onenand;
+	void __iomem *CTRL_BASE = onenandctl_vbase;
+	irqreturn_t ret = IRQ_NONE;
+	u32 status;
 
-	/* To handle shared interrupt */
-	if (!this->complete.done)
-		complete(&this->complete);
+	status = readl(CTRL_BASE + CTRL_INTC_DMA_STATUS_OFFSET);
+	if (status & INTC_DMA_ALL) {
+		if (status & INTC_DMA_TE)
+			writel(DMA_TRANSFER_ERROR, CTRL_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+		writel(DMA_TRANSFER_DONE, CTRL_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+		writel(status, CTRL_BASE + CTRL_INTC_DMA_CLR_OFFSET);
+
+		info->dma_status = status;
+		if (!info->dma_done.done)
+			complete(&info->dma_done);
+		ret = IRQ_HANDLED;
+	}
+
+	status = readl(CTRL_BASE + CTRL_INTC_ONENAND_STATUS_OFFSET);
+	if (status) {
+		writel(status, CTRL_BASE + CTRL_INTC_ONENAND_CLR_OFFSET);
+
+		/* Only the end of a command is of interest */
+		if (!this->complete.done &&
+		    (this->read_word(this->base + ONENAND_REG_INTERRUPT) &
+		     ONENAND_INT_MASTER))
+			complete(&this->complete);
+		ret = IRQ_HANDLED;
+	}
+
+	return ret;
+}
 
-	return IRQ_HANDLED;
+/*
+ * onenand_chip_irq - [Internal] pass the INT pin of the chip to the CPU
+ * @param enable	0 to mask it in the controller
+ */
+static void onenand_chip_irq(int enable)
+{
+	writel(enable ? 0 : ~0, onenandctl_vbase + CTRL_INTC_ONENAND_MASK_OFFSET);
+}
+
+/*
+ * onenand_dma_irq_mask - [Internal] mask or unmask the DMA interrupts
+ * @param info		OneNAND info structure
+ * @param masked	1 to mask them
+ *
+ * A polled transfer must not be acknowledged by the interrupt handler
+ * before the poll loop sees it, so the interrupts are masked for those.
+ */
+static void onenand_dma_irq_mask(struct onenand_info *info, int masked)
+{
+	void __iomem *CTRL_BASE = onenandctl_vbase;
+	u32 mask;
+
+	if (info->dma_masked == masked)
+		return;
+
+	mask = readl(CTRL_BASE + CTRL_INTC_DMA_MASK_OFFSET);
+	if (masked) {
+		mask |= INTC_DMA_ALL;
+	} else {
+		/* Polled transfers left their status pending */
+		writel(INTC_DMA_ALL, CTRL_BASE + CTRL_INTC_DMA_CLR_OFFSET);
+		mask &= ~INTC_DMA_ALL;
+	}
+	writel(mask, CTRL_BASE + CTRL_INTC_DMA_MASK_OFFSET);
+	info->dma_masked = masked;
 }
 
 /*
@@ -718,8 +845,12 @@ static int onenand_interrupt_wait(struct mtd_info *mtd, int state)
 {
 	struct onenand_chip *this = mtd->priv;
 
-	wait_for_completion(&this->complete);
+	if (wait_for_completion_timeout(&this->complete, msecs_to_jiffies(20)))
+		onenand_stats.wait_irq++;
+	else
+		onenand_stats.wait_timeout++;
 
+	/* Get the result, or keep polling if the interrupt was lost */
 	return onenand_wait(mtd, state);
 }
 
@@ -744,8 +875,8 @@ static int onenand_try_interrupt_wait(struct mtd_info *mtd, int state)
 		printk(KERN_INFO "OneNAND: There's no interrupt. "
 				"We use the normal wait\n");
 
-		/* Release the irq */
-		free_irq(this->irq, this);
+		/* Mask it, the DMA engine still uses the irq */
+		onenand_chip_irq(0);
 
 		this->wait = onenand_wait;
 	}
@@ -768,22 +899,17 @@ static void onenand_setup_wait(struct mtd_info *mtd)
 
 	init_completion(&this->complete);
 
+	/* The probe requested the irq already, if there is one */
 	if (this->irq <= 0) {
 		this->wait = onenand_wait;
 		return;
 	}
 
-	if (request_irq(this->irq, &onenand_interrupt,
-				IRQF_SHARED, "onenand", this)) {
-		/* If we can't get irq, use the normal wait */
-		this->wait = onenand_wait;
-		return;
-	}
-
 	/* Enable interrupt */
 	syscfg = this->read_word(this->base + ONENAND_REG_SYS_CFG1);
 	syscfg |= ONENAND_SYS_CFG1_IOBE;
 	this->write_word(syscfg, this->base + ONENAND_REG_SYS_CFG1);
+	onenand_chip_irq(1);
 
 	this->wait = onenand_try_interrupt_wait;
 }
@@ -811,6 +937,104 @@ static inline int onenand_bufferram_offset(struct mtd_info *mtd, int area)
 	return 0;
 }
 
+/**
+ * onenand_dma_ack - [Internal] acknowledge the end of a DMA transfer
+ * @param status	DMA transfer status
+ *
+ * Returns 0 when the transfer is done, -EIO when it failed and
+ * -ETIMEDOUT when it is still going on.
+ */
+static int onenand_dma_ack(u32 status)
+{
+	void __iomem *CTRL_DMA_BASE = onenandctl_vbase;
+
+	if (status & DMA_TRANSFER_ERROR) {
+		writel(DMA_TRANSFER_ERROR, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+		writel(DMA_TRANSFER_DONE, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+		return -EIO;
+	}
+
+	if (status & DMA_TRANSFER_DONE) {
+		writel(DMA_TRANSFER_DONE, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+		return 0;
+	}
+
+	return -ETIMEDOUT;
+}
+
+/**
+ * onenand_dma_abort - [Internal] stop a DMA transfer that did not end
+ *
+ * Called with the DMA interrupt masked, so that the CPU can copy the data
+ * instead without the engine still writing behind it.
+ */
+static void onenand_dma_abort(void)
+{
+	void __iomem *CTRL_DMA_BASE = onenandctl_vbase;
+	int i;
+
+	writel(0, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+	for (i = 0; i < DMA_POLL_STEPS; i++) {
+		if (!(readl(CTRL_DMA_BASE + CTRL_DMA_TRANS_STATUS_OFFSET) &
+		      DMA_TRANSFER_BUSY))
+			break;
+		udelay(1);
+	}
+	writel(DMA_TRANSFER_ERROR, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+	writel(DMA_TRANSFER_DONE, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
+}
+
+/**
+ * onenand_dma_poll - [Internal] spin until a DMA transfer ends
+ */
+static int onenand_dma_poll(void)
+{
+	void __iomem *CTRL_DMA_BASE = onenandctl_vbase;
+	u32 status = 0;
+	int i;
+
+	onenand_stats.dma_poll++;
+
+	for (i = 0; i < DMA_POLL_STEPS; i++) {
+		status = readl(CTRL_DMA_BASE + CTRL_DMA_TRANS_STATUS_OFFSET);
+		if (status & (DMA_TRANSFER_DONE | DMA_TRANSFER_ERROR))
+			break;
+		udelay(1);
+	}
+
+	return onenand_dma_ack(status);
+}
+
+/**
+ * onenand_dma_wait_irq - [Internal] sleep until a DMA transfer ends
+ * @param info		OneNAND info structure
+ */
+static int onenand_dma_wait_irq(struct onenand_info *info)
+{
+	void __iomem *CTRL_DMA_BASE = onenandctl_vbase;
+	int err;
+
+	if (!wait_for_completion_timeout(&info->dma_done,
+			msecs_to_jiffies(DMA_TIMEOUT_MS))) {
+		/*
+		 * Mask the interrupt before looking at the engine, so the
+		 * handler can't acknowledge the transfer behind our back.
+		 */
+		onenand_dma_irq_mask(info, 1);
+		if (!try_wait_for_completion(&info->dma_done)) {
+			err = onenand_dma_ack(readl(CTRL_DMA_BASE +
+					CTRL_DMA_TRANS_STATUS_OFFSET));
+			if (!err)
+				onenand_stats.dma_lost_irq++;
+			return err;
+		}
+	}
+
+	onenand_stats.dma_irq++;
+
+	return (info->dma_status & INTC_DMA_TE) ? -EIO : 0;
+}
+
 /**
  * onenand_dma_transfer - [Internal] DMA transfer
  * @param mtd		MTD data structure
@@ -819,15 +1043,20 @@ static inline int onenand_bufferram_offset(struct mtd_info *mtd, int area)
  * @param length	Length in bytes
  * @param direction	Transfer direction (0: In2Out, 1: Out2In)
  *
- * Transfer data through DMA
- * Assumption:
+ * Transfer data through DMA. Large transfers sleep until the interrupt
+ * says they are done, small ones and those in a panic are polled.
+ * On error the caller has to copy the data with the CPU, a transfer that
+ * timed out has been stopped by then.
  */
 static int onenand_dma_transfer(struct mtd_info *mtd, void __iomem *src,
 		void __iomem *dest, u32 length, u32 direction)
 {
-	//struct onenand_chip *this = mtd->priv;
+	struct onenand_info *info = container_of(mtd, struct onenand_info, mtd);
 	void __iomem *CTRL_DMA_BASE = onenandctl_vbase;
-	u32 status;
+	int use_irq, err;
+
+	use_irq = info->irq > 0 && length >= dma_irq_min && !oops_in_progress;
+	onenand_dma_irq_mask(info, !use_irq);
 
 	writel(src, CTRL_DMA_BASE + CTRL_DMA_SRC_ADDR_OFFSET);
 	writel(dest, CTRL_DMA_BASE + CTRL_DMA_DST_ADDR_OFFSET);
@@ -843,26 +1072,31 @@ static int onenand_dma_transfer(struct mtd_info *mtd, void __iomem *src,
 	writel(length, CTRL_DMA_BASE + CTRL_DMA_TRANS_SIZE_OFFSET);
 	writel(direction, CTRL_DMA_BASE + CTRL_DMA_TRANS_DIR_OFFSET);
 
+	if (use_irq)
+		INIT_COMPLETION(info->dma_done);
+
 	writel(0x1, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
 
-	while(1) {
-		status = readl(CTRL_DMA_BASE + CTRL_DMA_TRANS_STATUS_OFFSET);
-		if (status & DMA_TRANSFER_DONE) {
-			writel(DMA_TRANSFER_DONE, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
-			return 0;
-		}
+	if (use_irq)
+		err = onenand_dma_wait_irq(info);
+	else
+		err = onenand_dma_poll();
 
-		if (status & DMA_TRANSFER_ERROR) {
-			printk(KERN_ERR "onenand_dma_wait: DMA error!"
-				" [S: 0x%x, D: 0x%x, L: 0x%x]\n",
-				(u32)src, (u32)dest, length);
-			writel(DMA_TRANSFER_ERROR, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
-			writel(DMA_TRANSFER_DONE, CTRL_DMA_BASE + CTRL_DMA_TRANS_CMD_OFFSET);
-			return -EIO;
-		}
+	if (err == -ETIMEDOUT) {
+		onenand_dma_irq_mask(info, 1);
+		onenand_dma_abort();
+		onenand_stats.dma_timeout++;
 	}
 
-	return 0;
+	if (err) {
+		onenand_stats.dma_failed++;
+		printk_ratelimited(KERN_ERR "onenand_dma_transfer: DMA %s!"
+			" [S: 0x%x, D: 0x%x, L: 0x%x]\n",
+			err == -EIO ? "error" : "timeout",
+			(u32)src, (u32)dest, length);
+	}
+
+	return err;
 }
 
 /**
@@ -940,6 +1174,7 @@ static int onenand_sync_read_bufferram(struct mtd_info *mtd, int area,
 	struct onenand_chip *this = mtd->priv;
 	void __iomem *src_addr = NULL;
 	void __iomem *dest_addr = NULL;
+	int err;
 
 	/* physical address */
 	src_addr = (void __iomem *)onenand_pbase + area;
@@ -976,10 +1211,13 @@ static int onenand_sync_read_bufferram(struct mtd_info *mtd, int area,
 
 		__dma_single_cpu_to_dev(this->page_buf + point_min,
 			point_max - point_min, DMA_FROM_DEVICE);
-		onenand_dma_transfer(mtd, src_addr + point_min,
+		err = onenand_dma_transfer(mtd, src_addr + point_min,
 			dest_addr + point_min, point_max - point_min, DMA_IN2OUT);
 		__dma_single_dev_to_cpu(this->page_buf + point_min,
 			point_max - point_min, DMA_FROM_DEVICE);
+		if (err)
+			return onenand_read_bufferram(mtd, area, buffer,
+						      offset, count);
 
 		memcpy(buffer, this->page_buf + offset, count);
 
@@ -1003,9 +1241,12 @@ static int onenand_sync_read_bufferram(struct mtd_info *mtd, int area,
 		buffer[count] = (word & 0xff);
 	}
 
-	__dma_single_cpu_to_dev(buffer + offset, count, DMA_FROM_DEVICE);
-	onenand_dma_transfer(mtd, src_addr, dest_addr, count, DMA_IN2OUT);
-	__dma_single_dev_to_cpu(buffer + offset, count, DMA_FROM_DEVICE);
+	/* The DMA fills buffer from its start, offset is into BufferRAM */
+	__dma_single_cpu_to_dev(buffer, count, DMA_FROM_DEVICE);
+	err = onenand_dma_transfer(mtd, src_addr, dest_addr, count, DMA_IN2OUT);
+	__dma_single_dev_to_cpu(buffer, count, DMA_FROM_DEVICE);
+	if (err)
+		return onenand_read_bufferram(mtd, area, buffer, offset, count);
 
 	return 0;
 }
@@ -1117,6 +1358,7 @@ static int onenand_sync_write_bufferram(struct mtd_info *mtd, int area,
 	void __iomem *src_addr = NULL;
 	void __iomem *dest_addr = NULL;
 	void __iomem *bufferram = NULL;
+	int err;
 
 	if (area == ONENAND_SPARERAM) {
 		bufferram = this->base + area;
@@ -1169,12 +1411,18 @@ static int onenand_sync_write_bufferram(struct mtd_info *mtd, int area,
 	}
 #endif
 
+	if (!src_addr)
+		return onenand_write_bufferram(mtd, area, buffer, offset, count);
+
 	dest_addr = (void __iomem *)onenand_pbase + area;
 	dest_addr += onenand_bufferram_offset(mtd, area) + offset;
 
-	__dma_single_cpu_to_dev(buffer + offset, count, DMA_TO_DEVICE);
-	onenand_dma_transfer(mtd, src_addr, dest_addr, count, DMA_OUT2IN);
-	__dma_single_dev_to_cpu(buffer + offset, count, DMA_TO_DEVICE);
+	/* The DMA reads buffer from its start, offset is into BufferRAM */
+	__dma_single_cpu_to_dev(buffer, count, DMA_TO_DEVICE);
+	err = onenand_dma_transfer(mtd, src_addr, dest_addr, count, DMA_OUT2IN);
+	__dma_single_dev_to_cpu(buffer, count, DMA_TO_DEVICE);
+	if (err)
+		return onenand_write_bufferram(mtd, area, buffer, offset, count);
 
 	return 0;
 }
@@ -1535,9 +1783,15 @@ static int onenand_multiple_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 			ret = 0;
 	}
 
+	if (load < len)
+		onenand_stats.read_overlap++;
+	else
+		onenand_stats.read_single++;
+
 	/* Super load: Issue superload command to the second block ~ (Last - 1) block */
 	while (load < len) {
 		this->command(mtd, ONENAND_CMD_SUPERLOAD, from, writesize);
+		onenand_stats.read_overlap_pages++;
 
 		this->read_bufferram(mtd, ONENAND_DATARAM, buf, column, thislen);
 		buf += thislen;
@@ -1762,11 +2016,17 @@ static int onenand_read_ops_nolock(struct mtd_info *mtd, loff_t from,
 	if (column + thislen > writesize)
 		thislen = writesize - column;
 
+	if (read + thislen < len)
+		onenand_stats.read_overlap++;
+	else
+		onenand_stats.read_single++;
+
 	while (!ret) {
 		/* If there is more to load then start next load */
 		from += thislen;
 		if (read + thislen < len) {
 			this->command(mtd, ONENAND_CMD_READ, from, writesize);
+			onenand_stats.read_overlap_pages++;
 			/*
 			 * Chip boundary handling in DDP
 			 * Now we issued chip 1 read and pointed chip 1
@@ -1850,7 +2110,7 @@ static int onenand_read_oob_nolock(struct mtd_info *mtd, loff_t from,
 	size_t len = ops->ooblen;
 	mtd_oob_mode_t mode = ops->mode;
 	u_char *buf = ops->oobbuf;
-	int ret = 0, readcmd;
+	int ret = 0, readcmd, single, more, boundary = 0;
 
 	from += ops->ooboffs;
 
@@ -1881,45 +2141,86 @@ static int onenand_read_oob_nolock(struct mtd_info *mtd, loff_t from,
 
 	stats = mtd->ecc_stats;
 
-	readcmd = ONENAND_NO_OOB_CMD(this) ? ONENAND_CMD_READ : ONENAND_CMD_READOOB;
+	if (unlikely(!len))
+		return 0;
 
-	while (read < len) {
-		//cond_resched();
+	readcmd = ONENAND_NO_OOB_CMD(this) ? ONENAND_CMD_READ : ONENAND_CMD_READOOB;
+	single = ONENAND_IS_SINGLE_DATARAM(this);
 
-		thislen = oobsize - column;
-		thislen = min_t(int, thislen, len);
+	thislen = oobsize - column;
+	thislen = min_t(int, thislen, len);
 
-		this->command(mtd, readcmd, from, mtd->oobsize);
+	if (thislen < len)
+		onenand_stats.read_overlap++;
+	else
+		onenand_stats.read_single++;
 
-		onenand_update_bufferram(mtd, from, 0);
+	/* Do first load to bufferRAM */
+	this->command(mtd, readcmd, from, mtd->oobsize);
+	onenand_update_bufferram(mtd, from, 0);
 
-		ret = this->wait(mtd, FL_READING);
-		if (unlikely(ret))
-			ret = onenand_recover_lsb(mtd, from, ret);
+	ret = this->wait(mtd, FL_READING);
+	if (unlikely(ret))
+		ret = onenand_recover_lsb(mtd, from, ret);
 
+	while (1) {
 		if (ret && ret != -EBADMSG) {
 			printk(KERN_ERR "onenand_read_oob_nolock: read failed = 0x%x\n", ret);
 			break;
 		}
 
+		/*
+		 * If there is more to load then start next load: into the
+		 * other BufferRAM, or with Superload if there's only one.
+		 */
+		more = read + thislen < len;
+		if (more) {
+			from += mtd->writesize;
+			onenand_stats.read_overlap_pages++;
+			if (single) {
+				this->command(mtd, ONENAND_CMD_SUPERLOAD, from, mtd->writesize);
+			} else {
+				this->command(mtd, readcmd, from, mtd->oobsize);
+				/* Chip boundary handling in DDP, see onenand_read_ops_nolock */
+				if (ONENAND_IS_DDP(this) &&
+				    unlikely(from == (this->chipsize >> 1))) {
+					this->write_word(ONENAND_DDP_CHIP0, this->base + ONENAND_REG_START_ADDRESS2);
+					boundary = 1;
+				} else
+					boundary = 0;
+				ONENAND_SET_PREV_BUFFERRAM(this);
+			}
+		}
+
+		/* While load is going, read from last bufferRAM */
 		if (mode == MTD_OOB_AUTO)
 			onenand_transfer_auto_oob(mtd, buf, column, thislen);
 		else
 			this->read_bufferram(mtd, ONENAND_SPARERAM, buf, column, thislen);
 
 		read += thislen;
-
-		if (read == len)
+		if (!more)
 			break;
 
 		buf += thislen;
+		thislen = min_t(int, oobsize, len - read);
+		column = 0;
 
-		/* Read more? */
-		if (read < len) {
-			/* Page size */
-			from += mtd->writesize;
-			column = 0;
+		if (single) {
+			// Magic(?) instruction, as after each Superload
+			this->read_word(this->base + 0x1009e);
+		} else {
+			/* Set up for next read from bufferRAM */
+			if (unlikely(boundary))
+				this->write_word(ONENAND_DDP_CHIP1, this->base + ONENAND_REG_START_ADDRESS2);
+			ONENAND_SET_NEXT_BUFFERRAM(this);
+			onenand_update_bufferram(mtd, from, 0);
 		}
+
+		/* Now wait for load */
+		ret = this->wait(mtd, FL_READING);
+		if (unlikely(ret))
+			ret = onenand_recover_lsb(mtd, from, ret);
 	}
 
 	ops->oobretlen = read;
@@ -4342,7 +4643,20 @@ static int __devinit s5p_onenand_probe(struct platform_device *dev)
 #endif
 
 	//info->onenand.mmcontrol = pdata->mmcontrol;
-	info->onenand.irq = platform_get_irq(pdev, 0);
+
+	/* Start with both interrupts masked, they get enabled when used */
+	info->dma_masked = -1;
+	onenand_dma_irq_mask(info, 1);
+	onenand_chip_irq(0);
+	init_completion(&info->dma_done);
+
+	info->irq = platform_get_irq(pdev, 0);
+	if (info->irq > 0 && request_irq(info->irq, onenand_interrupt,
+					 IRQF_SHARED, "onenand", info)) {
+		printk(KERN_INFO "OneNAND: Failed to get irq, polling\n");
+		info->irq = 0;
+	}
+	info->onenand.irq = info->irq;
 
 	info->mtd.name = dev_name(&pdev->dev);
 	info->mtd.priv = &info->onenand;
@@ -4350,7 +4664,7 @@ static int __devinit s5p_onenand_probe(struct platform_device *dev)
 
 	if (onenand_scan(&info->mtd, 1)) {
 		err = -ENXIO;
-		goto out_iounmap2;
+		goto out_free_irq;
 	}
 
 #ifdef CONFIG_MTD_CMDLINE_PARTS
@@ -4380,6 +4694,9 @@ static int __devinit s5p_onenand_probe(struct platform_device *dev)
 
 out_release_onenand:
 	onenand_release(&info->mtd);
+out_free_irq:
+	if (info->irq > 0)
+		free_irq(info->irq, info);
 out_iounmap2:
 	iounmap(onenandctl_vbase);
 out_release_mem_region2:
@@ -4409,6 +4726,19 @@ static int s5p_onenand_resume(struct platform_device *pdev)
 {
 	struct onenand_info *info = dev_get_drvdata(&pdev->dev);
 
+	/* The controller may have lost its interrupt masks */
+	if (info->irq > 0) {
+#ifdef ONENAND_CLOCK_GATING
+		onenand_clock_gating(ONENAND_CLOCK_ON);
+#endif
+		info->dma_masked = -1;
+		onenand_dma_irq_mask(info, 1);
+		onenand_chip_irq(info->onenand.wait != onenand_wait);
+#ifdef ONENAND_CLOCK_GATING
+		onenand_clock_gating(ONENAND_CLOCK_OFF);
+#endif
+	}
+
 	/* Unlock whole block */
 	info->onenand.unlock_all(&info->mtd);
 
@@ -4432,6 +4762,8 @@ static int __devexit s5p_onenand_remove(struct platform_device *dev)
 		mtd_device_unregister(&info->mtd);
 
 		onenand_release(&info->mtd);
+		if (info->irq > 0)
+			free_irq(info->irq, info);
 		release_mem_region(info->ctl_res->start, resource_size(info->ctl_res));
 		iounmap(onenandctl_vbase);
 		release_mem_region(info->base_res->start, resource_size(info->base_res));
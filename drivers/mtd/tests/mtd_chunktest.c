@@ -0,0 +1,357 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; see the file COPYING. If not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Test sequential throughput of a MTD device the way a flash file system
+ * like yaffs2 uses it: each page is written with its data and some
+ * MTD_OOB_AUTO oob, and read back without the oob. The pages are passed
+ * to the driver in runs of 1, 2, 4, ... pages per request, to show what
+ * batching consecutive chunks into one request is worth.
+ *
+ * Based on mtd_speedtest by Adrian Hunter.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/err.h>
+#include <linux/mtd/mtd.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+
+#define PRINT_PREF KERN_INFO "mtd_chunktest: "
+
+static int dev;
+module_param(dev, int, S_IRUGO);
+MODULE_PARM_DESC(dev, "MTD device number to use");
+
+static int count;
+module_param(count, int, S_IRUGO);
+MODULE_PARM_DESC(count, "Maximum number of eraseblocks to use "
+			"(0 means use all)");
+
+static int maxrun = 8;
+module_param(maxrun, int, S_IRUGO);
+MODULE_PARM_DESC(maxrun, "Largest number of pages per request to test");
+
+static struct mtd_info *mtd;
+static unsigned char *iobuf;
+static unsigned char *oobbuf;
+static unsigned char *bbt;
+
+static int pgsize;
+static int ebcnt;
+static int pgcnt;
+static int goodebcnt;
+static struct timeval start, finish;
+static unsigned long next = 1;
+
+static inline unsigned int simple_rand(void)
+{
+	next = next * 1103515245 + 12345;
+	return (unsigned int)((next / 65536) % 32768);
+}
+
+static inline void simple_srand(unsigned long seed)
+{
+	next = seed;
+}
+
+static void set_random_data(unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		buf[i] = simple_rand();
+}
+
+static int erase_eraseblock(int ebnum)
+{
+	int err;
+	struct erase_info ei;
+	loff_t addr = ebnum * mtd->erasesize;
+
+	memset(&ei, 0, sizeof(struct erase_info));
+	ei.mtd  = mtd;
+	ei.addr = addr;
+	ei.len  = mtd->erasesize;
+
+	err = mtd->erase(mtd, &ei);
+	if (err) {
+		printk(PRINT_PREF "error %d while erasing EB %d\n", err, ebnum);
+		return err;
+	}
+
+	if (ei.state == MTD_ERASE_FAILED) {
+		printk(PRINT_PREF "some erase error occurred at EB %d\n",
+		       ebnum);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int erase_whole_device(void)
+{
+	int err;
+	unsigned int i;
+
+	for (i = 0; i < ebcnt; ++i) {
+		if (bbt[i])
+			continue;
+		err = erase_eraseblock(i);
+		if (err)
+			return err;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* Write an eraseblock, data and oob, run pages per request */
+static int write_eraseblock_by_run(int ebnum, int run)
+{
+	struct mtd_oob_ops ops;
+	loff_t addr = ebnum * mtd->erasesize;
+	int i, n, err = 0;
+
+	for (i = 0; i < pgcnt; i += n) {
+		n = min(run, pgcnt - i);
+		ops.mode      = MTD_OOB_AUTO;
+		ops.len       = n * pgsize;
+		ops.retlen    = 0;
+		ops.ooblen    = n * mtd->oobavail;
+		ops.oobretlen = 0;
+		ops.ooboffs   = 0;
+		ops.datbuf    = iobuf + i * pgsize;
+		ops.oobbuf    = oobbuf + i * mtd->oobavail;
+		err = mtd->write_oob(mtd, addr, &ops);
+		if (err || ops.retlen != ops.len) {
+			printk(PRINT_PREF "error: write failed at %#llx\n",
+			       addr);
+			if (!err)
+				err = -EINVAL;
+			break;
+		}
+		addr += n * pgsize;
+	}
+
+	return err;
+}
+
+/* Read the data of an eraseblock back, run pages per request */
+static int read_eraseblock_by_run(int ebnum, int run)
+{
+	size_t read = 0;
+	loff_t addr = ebnum * mtd->erasesize;
+	int i, n, err = 0;
+
+	for (i = 0; i < pgcnt; i += n) {
+		n = min(run, pgcnt - i);
+		err = mtd->read(mtd, addr, n * pgsize, &read,
+				iobuf + i * pgsize);
+		/* Ignore corrected ECC errors */
+		if (err == -EUCLEAN)
+			err = 0;
+		if (err || read != n * pgsize) {
+			printk(PRINT_PREF "error: read failed at %#llx\n",
+			       addr);
+			if (!err)
+				err = -EINVAL;
+			break;
+		}
+		addr += n * pgsize;
+	}
+
+	return err;
+}
+
+static int is_block_bad(int ebnum)
+{
+	loff_t addr = ebnum * mtd->erasesize;
+	int ret;
+
+	ret = mtd->block_isbad(mtd, addr);
+	if (ret)
+		printk(PRINT_PREF "block %d is bad\n", ebnum);
+	return ret;
+}
+
+static inline void start_timing(void)
+{
+	do_gettimeofday(&start);
+}
+
+static inline void stop_timing(void)
+{
+	do_gettimeofday(&finish);
+}
+
+static long calc_speed(void)
+{
+	uint64_t k;
+	long ms;
+
+	ms = (finish.tv_sec - start.tv_sec) * 1000 +
+	     (finish.tv_usec - start.tv_usec) / 1000;
+	if (ms == 0)
+		return 0;
+	k = goodebcnt * (mtd->erasesize / 1024) * 1000;
+	do_div(k, ms);
+	return k;
+}
+
+static int scan_for_bad_eraseblocks(void)
+{
+	int i, bad = 0;
+
+	bbt = kzalloc(ebcnt, GFP_KERNEL);
+	if (!bbt) {
+		printk(PRINT_PREF "error: cannot allocate memory\n");
+		return -ENOMEM;
+	}
+
+	if (mtd->block_isbad == NULL)
+		goto out;
+
+	printk(PRINT_PREF "scanning for bad eraseblocks\n");
+	for (i = 0; i < ebcnt; ++i) {
+		bbt[i] = is_block_bad(i) ? 1 : 0;
+		if (bbt[i])
+			bad += 1;
+		cond_resched();
+	}
+	printk(PRINT_PREF "scanned %d eraseblocks, %d are bad\n", i, bad);
+out:
+	goodebcnt = ebcnt - bad;
+	return 0;
+}
+
+static int __init mtd_chunktest_init(void)
+{
+	int err, i, run;
+	long speed;
+	uint64_t tmp;
+
+	printk(KERN_INFO "\n");
+	printk(KERN_INFO "=================================================\n");
+	if (count)
+		printk(PRINT_PREF "MTD device: %d    count: %d\n", dev, count);
+	else
+		printk(PRINT_PREF "MTD device: %d\n", dev);
+
+	mtd = get_mtd_device(NULL, dev);
+	if (IS_ERR(mtd)) {
+		err = PTR_ERR(mtd);
+		printk(PRINT_PREF "error: cannot get MTD device\n");
+		return err;
+	}
+
+	if (mtd->writesize == 1 || !mtd->write_oob) {
+		printk(PRINT_PREF "this test requires NAND flash\n");
+		err = -ENODEV;
+		goto out;
+	}
+
+	pgsize = mtd->writesize;
+	tmp = mtd->size;
+	do_div(tmp, mtd->erasesize);
+	ebcnt = tmp;
+	pgcnt = mtd->erasesize / pgsize;
+
+	printk(PRINT_PREF "MTD device size %llu, eraseblock size %u, "
+	       "page size %u, count of eraseblocks %u, pages per "
+	       "eraseblock %u, OOB available %u\n",
+	       (unsigned long long)mtd->size, mtd->erasesize,
+	       pgsize, ebcnt, pgcnt, mtd->oobavail);
+
+	if (count > 0 && count < ebcnt)
+		ebcnt = count;
+	if (maxrun < 1)
+		maxrun = 1;
+
+	err = -ENOMEM;
+	iobuf = kmalloc(mtd->erasesize, GFP_KERNEL);
+	oobbuf = kmalloc(pgcnt * mtd->oobavail, GFP_KERNEL);
+	if (!iobuf || !oobbuf) {
+		printk(PRINT_PREF "error: cannot allocate memory\n");
+		goto out;
+	}
+
+	simple_srand(1);
+	set_random_data(iobuf, mtd->erasesize);
+	set_random_data(oobbuf, pgcnt * mtd->oobavail);
+
+	err = scan_for_bad_eraseblocks();
+	if (err)
+		goto out;
+
+	for (run = 1; run <= maxrun && run <= pgcnt; run <<= 1) {
+		err = erase_whole_device();
+		if (err)
+			goto out;
+
+		printk(PRINT_PREF "testing %d page per request write speed\n",
+		       run);
+		start_timing();
+		for (i = 0; i < ebcnt; ++i) {
+			if (bbt[i])
+				continue;
+			err = write_eraseblock_by_run(i, run);
+			if (err)
+				goto out;
+			cond_resched();
+		}
+		stop_timing();
+		speed = calc_speed();
+		printk(PRINT_PREF "%d page per request write speed is "
+		       "%ld KiB/s\n", run, speed);
+
+		printk(PRINT_PREF "testing %d page per request read speed\n",
+		       run);
+		start_timing();
+		for (i = 0; i < ebcnt; ++i) {
+			if (bbt[i])
+				continue;
+			err = read_eraseblock_by_run(i, run);
+			if (err)
+				goto out;
+			cond_resched();
+		}
+		stop_timing();
+		speed = calc_speed();
+		printk(PRINT_PREF "%d page per request read speed is "
+		       "%ld KiB/s\n", run, speed);
+	}
+
+	err = erase_whole_device();
+	printk(PRINT_PREF "finished\n");
+out:
+	kfree(iobuf);
+	kfree(oobbuf);
+	kfree(bbt);
+	put_mtd_device(mtd);
+	if (err)
+		printk(PRINT_PREF "error %d occurred\n", err);
+	printk(KERN_INFO "=================================================\n");
+	return err;
+}
+module_init(mtd_chunktest_init);
+
+static void __exit mtd_chunktest_exit(void)
+{
+	return;
+}
+module_exit(mtd_chunktest_exit);
+
+MODULE_DESCRIPTION("Multi-page request throughput test module");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,383 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; see the file COPYING. If not, write to the Free Software
+ * Foundation, 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Test read and write speed of a MTD device together with what it costs
+ * in CPU time. A driver that spins while the flash is busy and one that
+ * sleeps until an interrupt may move data equally fast, but only the
+ * second leaves the CPU to other work. For each test two figures are
+ * given: "cpu" is the share of the time the test thread was running,
+ * "busy" the share of the time the CPUs were not idle, which includes
+ * interrupt handlers and whatever else ran meanwhile.
+ *
+ * Based on mtd_speedtest by Adrian Hunter.
+ */
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/err.h>
+#include <linux/mtd/mtd.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/kernel_stat.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#define PRINT_PREF KERN_INFO "mtd_cputest: "
+
+static int dev;
+module_param(dev, int, S_IRUGO);
+MODULE_PARM_DESC(dev, "MTD device number to use");
+
+static int count;
+module_param(count, int, S_IRUGO);
+MODULE_PARM_DESC(count, "Maximum number of eraseblocks to use "
+			"(0 means use all)");
+
+static struct mtd_info *mtd;
+static unsigned char *iobuf;
+static unsigned char *bbt;
+
+static int pgsize;
+static int ebcnt;
+static int pgcnt;
+static int goodebcnt;
+static unsigned long next = 1;
+
+struct cpu_sample {
+	ktime_t		wall;
+	u64		runtime;	/* ns the test thread ran */
+	cputime64_t	idle;		/* idle and iowait of all CPUs */
+};
+
+static struct cpu_sample start, finish;
+
+static inline unsigned int simple_rand(void)
+{
+	next = next * 1103515245 + 12345;
+	return (unsigned int)((next / 65536) % 32768);
+}
+
+static inline void simple_srand(unsigned long seed)
+{
+	next = seed;
+}
+
+static void set_random_data(unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		buf[i] = simple_rand();
+}
+
+static int erase_eraseblock(int ebnum)
+{
+	int err;
+	struct erase_info ei;
+	loff_t addr = ebnum * mtd->erasesize;
+
+	memset(&ei, 0, sizeof(struct erase_info));
+	ei.mtd  = mtd;
+	ei.addr = addr;
+	ei.len  = mtd->erasesize;
+
+	err = mtd->erase(mtd, &ei);
+	if (err) {
+		printk(PRINT_PREF "error %d while erasing EB %d\n", err, ebnum);
+		return err;
+	}
+
+	if (ei.state == MTD_ERASE_FAILED) {
+		printk(PRINT_PREF "some erase error occurred at EB %d\n",
+		       ebnum);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int erase_whole_device(void)
+{
+	int err;
+	unsigned int i;
+
+	for (i = 0; i < ebcnt; ++i) {
+		if (bbt[i])
+			continue;
+		err = erase_eraseblock(i);
+		if (err)
+			return err;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* Write an eraseblock, len bytes per request */
+static int write_eraseblock(int ebnum, int len)
+{
+	size_t written;
+	loff_t addr = ebnum * mtd->erasesize;
+	int i, err = 0;
+
+	for (i = 0; i < mtd->erasesize; i += len) {
+		written = 0;
+		err = mtd->write(mtd, addr + i, len, &written, iobuf + i);
+		if (err || written != len) {
+			printk(PRINT_PREF "error: write failed at %#llx\n",
+			       addr + i);
+			if (!err)
+				err = -EINVAL;
+			break;
+		}
+	}
+
+	return err;
+}
+
+/* Read an eraseblock, len bytes per request */
+static int read_eraseblock(int ebnum, int len)
+{
+	size_t read;
+	loff_t addr = ebnum * mtd->erasesize;
+	int i, err = 0;
+
+	for (i = 0; i < mtd->erasesize; i += len) {
+		read = 0;
+		err = mtd->read(mtd, addr + i, len, &read, iobuf + i);
+		/* Ignore corrected ECC errors */
+		if (err == -EUCLEAN)
+			err = 0;
+		if (err || read != len) {
+			printk(PRINT_PREF "error: read failed at %#llx\n",
+			       addr + i);
+			if (!err)
+				err = -EINVAL;
+			break;
+		}
+	}
+
+	return err;
+}
+
+static int is_block_bad(int ebnum)
+{
+	loff_t addr = ebnum * mtd->erasesize;
+	int ret;
+
+	ret = mtd->block_isbad(mtd, addr);
+	if (ret)
+		printk(PRINT_PREF "block %d is bad\n", ebnum);
+	return ret;
+}
+
+static void take_sample(struct cpu_sample *s)
+{
+	cputime64_t idle = cputime64_zero;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		idle = cputime64_add(idle, kstat_cpu(cpu).cpustat.idle);
+		idle = cputime64_add(idle, kstat_cpu(cpu).cpustat.iowait);
+	}
+	s->idle = idle;
+	s->runtime = current->se.sum_exec_runtime;
+	s->wall = ktime_get();
+}
+
+static inline void start_timing(void)
+{
+	take_sample(&start);
+}
+
+static inline void stop_timing(void)
+{
+	take_sample(&finish);
+}
+
+static void report(const char *what)
+{
+	u64 wall, runtime, idle, kib;
+	unsigned int cpu, busy;
+
+	wall = ktime_to_ns(ktime_sub(finish.wall, start.wall));
+	if (wall == 0)
+		wall = 1;
+	runtime = finish.runtime - start.runtime;
+	idle = cputime64_to_jiffies64(cputime64_sub(finish.idle, start.idle));
+	idle *= TICK_NSEC;
+
+	kib = (u64)goodebcnt * (mtd->erasesize / 1024) * NSEC_PER_SEC;
+	kib = div64_u64(kib, wall);
+	cpu = div64_u64(runtime * 100, wall);
+	busy = div64_u64(idle * 100, wall * num_online_cpus());
+	busy = busy > 100 ? 0 : 100 - busy;
+
+	printk(PRINT_PREF "%s speed is %llu.%02llu MiB/s, "
+	       "cpu %u%%, busy %u%%\n", what,
+	       (unsigned long long)kib / 1024,
+	       (unsigned long long)(kib % 1024) * 100 / 1024,
+	       min(cpu, 100U), busy);
+}
+
+static int scan_for_bad_eraseblocks(void)
+{
+	int i, bad = 0;
+
+	bbt = kzalloc(ebcnt, GFP_KERNEL);
+	if (!bbt) {
+		printk(PRINT_PREF "error: cannot allocate memory\n");
+		return -ENOMEM;
+	}
+
+	if (mtd->block_isbad == NULL)
+		goto out;
+
+	printk(PRINT_PREF "scanning for bad eraseblocks\n");
+	for (i = 0; i < ebcnt; ++i) {
+		bbt[i] = is_block_bad(i) ? 1 : 0;
+		if (bbt[i])
+			bad += 1;
+		cond_resched();
+	}
+	printk(PRINT_PREF "scanned %d eraseblocks, %d are bad\n", i, bad);
+out:
+	goodebcnt = ebcnt - bad;
+	return 0;
+}
+
+/* Write the whole device, then read it back, len bytes per request */
+static int run_test(int len, const char *name)
+{
+	char what[32];
+	int err, i;
+
+	err = erase_whole_device();
+	if (err)
+		return err;
+
+	printk(PRINT_PREF "testing %s write speed\n", name);
+	start_timing();
+	for (i = 0; i < ebcnt; ++i) {
+		if (bbt[i])
+			continue;
+		err = write_eraseblock(i, len);
+		if (err)
+			return err;
+		cond_resched();
+	}
+	stop_timing();
+	snprintf(what, sizeof(what), "%s write", name);
+	report(what);
+
+	printk(PRINT_PREF "testing %s read speed\n", name);
+	start_timing();
+	for (i = 0; i < ebcnt; ++i) {
+		if (bbt[i])
+			continue;
+		err = read_eraseblock(i, len);
+		if (err)
+			return err;
+		cond_resched();
+	}
+	stop_timing();
+	snprintf(what, sizeof(what), "%s read", name);
+	report(what);
+
+	return 0;
+}
+
+static int __init mtd_cputest_init(void)
+{
+	int err;
+	uint64_t tmp;
+
+	printk(KERN_INFO "\n");
+	printk(KERN_INFO "=================================================\n");
+	if (count)
+		printk(PRINT_PREF "MTD device: %d    count: %d\n", dev, count);
+	else
+		printk(PRINT_PREF "MTD device: %d\n", dev);
+
+	mtd = get_mtd_device(NULL, dev);
+	if (IS_ERR(mtd)) {
+		err = PTR_ERR(mtd);
+		printk(PRINT_PREF "error: cannot get MTD device\n");
+		return err;
+	}
+
+	if (mtd->writesize == 1) {
+		printk(PRINT_PREF "not NAND flash, assume page size is 512 "
+		       "bytes.\n");
+		pgsize = 512;
+	} else
+		pgsize = mtd->writesize;
+
+	tmp = mtd->size;
+	do_div(tmp, mtd->erasesize);
+	ebcnt = tmp;
+	pgcnt = mtd->erasesize / pgsize;
+
+	printk(PRINT_PREF "MTD device size %llu, eraseblock size %u, "
+	       "page size %u, count of eraseblocks %u, pages per "
+	       "eraseblock %u, OOB size %u\n",
+	       (unsigned long long)mtd->size, mtd->erasesize,
+	       pgsize, ebcnt, pgcnt, mtd->oobsize);
+
+	if (count > 0 && count < ebcnt)
+		ebcnt = count;
+
+	err = -ENOMEM;
+	iobuf = kmalloc(mtd->erasesize, GFP_KERNEL);
+	if (!iobuf) {
+		printk(PRINT_PREF "error: cannot allocate memory\n");
+		goto out;
+	}
+
+	simple_srand(1);
+	set_random_data(iobuf, mtd->erasesize);
+
+	err = scan_for_bad_eraseblocks();
+	if (err)
+		goto out;
+
+	err = run_test(mtd->erasesize, "eraseblock");
+	if (err)
+		goto out;
+
+	err = run_test(pgsize, "page");
+	if (err)
+		goto out;
+
+	err = erase_whole_device();
+	printk(PRINT_PREF "finished\n");
+out:
+	kfree(iobuf);
+	kfree(bbt);
+	put_mtd_device(mtd);
+	if (err)
+		printk(PRINT_PREF "error %d occurred\n", err);
+	printk(KERN_INFO "=================================================\n");
+	return err;
+}
+module_init(mtd_cputest_init);
+
+static void __exit mtd_cputest_exit(void)
+{
+	return;
+}
+module_exit(mtd_cputest_exit);
+
+MODULE_DESCRIPTION("Speed and CPU usage test module");
+MODULE_LICENSE("GPL");
@@ -21,46 +21,125 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
 #include <linux/time.h>
+#include <linux/lzo.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/* the largest entry, header included, that goes into a log */
+#define LOGGER_ENTRY_MAX_LEN \
+	(sizeof(struct logger_entry) + LOGGER_ENTRY_MAX_PAYLOAD)
+
+/* entries evicted from the ring are archived in segments of this size */
+#define LOGGER_SEGMENT_SIZE	(16 * 1024)
+
+/*
+ * struct logger_segment - a run of whole entries evicted from the ring
+ *
+ * A sealed segment stays raw until logger_compress_work() gets to it. A
+ * reader decompressing it, or the work compressing it, holds a reference
+ * in 'users'; a segment trimmed meanwhile is unlinked and then freed by
+ * its last user. Protected by log->lock.
+ */
+struct logger_segment {
+	struct list_head	list;	/* entry in logger_log's segments */
+	__u32			start;	/* position of the first entry */
+	size_t			len;	/* bytes of entries */
+	size_t			clen;	/* compressed length, 0 while raw */
+	int			users;	/* references held outside the lock */
+	unsigned char		*data;	/* the entries, maybe compressed */
+};
+
+struct logger_archive_stats {
+	unsigned long		segments; /* segments compressed */
+	u64			raw_bytes; /* their size before compression */
+	u64			compressed_bytes; /* and after */
+	u64			compress_ns; /* time spent compressing */
+	u64			decompress_ns; /* and decompressing */
+	unsigned long		dropped; /* entries we had no room for */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', which is only ever held to copy entries in and out of the
+ * ring; copies from and to user space are done outside of it.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	struct logger_mmap_info	*info;	/* first page of the mmap() */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct list_head	segments; /* archived entries, oldest first */
+	struct logger_segment	*stage;	/* segment being filled */
+	struct logger_segment	*spare;	/* the next stage, allocated ahead */
+	size_t			a_bytes; /* memory used by the segments */
+	struct work_struct	work;	/* compresses sealed segments */
+	struct logger_archive_stats stats;
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. r_off is protected by log->lock, the rest by 'mutex',
+ * which serialises reads through the same file.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
+	struct mutex		mutex;	/* one read at a time */
 	size_t			r_off;	/* current read head offset */
 	bool			r_all;	/* reader can read all entries */
+	bool			r_batch; /* read() as many entries as fit */
 	int			r_ver;	/* reader ABI version */
+	unsigned char		*scratch; /* entry being copied to the user */
+	bool			r_archived; /* reading from the archive */
+	__u32			a_pos;	/* position in the archive */
+	__u32			a_start; /* position of the segment in a_buf */
+	size_t			a_len;	/* its length, 0 if a_buf is unused */
+	unsigned char		*a_buf;	/* a decompressed segment */
 };
 
+/*
+ * Writers gather their entry in this CPU's staging buffer, with page faults
+ * disabled, and then only hold log->lock for a memcpy() into the ring. This
+ * keeps faults on the user's buffer, and the writers stuck behind them, out
+ * of the locked section. A write that faults is staged in a kmalloc()ed
+ * buffer instead.
+ */
+static DEFINE_PER_CPU(unsigned char [LOGGER_ENTRY_MAX_PAYLOAD], logger_stage);
+
+/*
+ * With archive_kb set, entries the writers push out of a ring are not lost
+ * but kept, lzo compressed, in up to that many KiB per log, and readers go
+ * through them before the ring. Zero turns the archive off.
+ */
+static unsigned int logger_archive_kb;
+module_param_named(archive_kb, logger_archive_kb, uint, S_IWUSR | S_IRUGO);
+
+/* shared by the compress works of all logs */
+static DEFINE_MUTEX(logger_lzo_mutex);
+static void *logger_lzo_wrkmem;
+static unsigned char *logger_lzo_dst;
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -112,7 +191,7 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * get_entry_msg_len - Grabs the length of the message of the entry
  * starting from from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
@@ -156,54 +235,437 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log - copies the whole entry at 'off', header and message, out of
+ * the ring into 'dst', which must hold LOGGER_ENTRY_MAX_LEN bytes. Returns
+ * the length of the entry.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static size_t do_read_log(struct logger_log *log, size_t off, void *dst)
 {
-	struct logger_entry scratch;
-	struct logger_entry *entry;
+	size_t count = sizeof(struct logger_entry) +
+		get_entry_msg_len(log, off);
 	size_t len;
-	size_t msg_start;
 
 	/*
-	 * First, copy the header to userspace, using the version of
-	 * the header requested
+	 * We read the entry in two disjoint operations. First, up to the end
+	 * of the log, then any remaining bytes from the head of the log.
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
+	len = min(count, log->size - off);
+	memcpy(dst, log->buffer + off, len);
+
+	if (count != len)
+		memcpy(dst + len, log->buffer, count - len);
+
+	return count;
+}
+
+/*
+ * do_read_log_to_user - copies the entry staged in the reader's scratch
+ * buffer, with the header version the reader asked for, to the user-space
+ * buffer 'buf'. Returns the number of bytes copied.
+ */
+static ssize_t do_read_log_to_user(struct logger_reader *reader,
+				   char __user *buf)
+{
+	struct logger_entry *entry = (struct logger_entry *) reader->scratch;
+	size_t hdr_len = get_user_hdr_len(reader->r_ver);
+
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
-	count -= get_user_hdr_len(reader->r_ver);
-	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(reader->r_off + sizeof(struct logger_entry));
-
-	/*
-	 * We read from the msg in two disjoint operations. First, we read from
-	 * the current msg head offset up to 'count' bytes or to the end of
-	 * the log, whichever comes first.
-	 */
-	len = min(count, log->size - msg_start);
-	if (copy_to_user(buf, log->buffer + msg_start, len))
+	if (copy_to_user(buf + hdr_len, entry->msg, entry->len))
 		return -EFAULT;
 
-	/*
-	 * Second, we read any remaining bytes, starting back at the head of
-	 * the log.
-	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+	return hdr_len + entry->len;
+}
+
+static ssize_t do_read_entry(struct logger_reader *reader,
+			     char __user *buf, size_t count);
 
-	reader->r_off = logger_offset(reader->r_off +
-		sizeof(struct logger_entry) + count);
+static struct logger_segment *logger_alloc_segment(gfp_t gfp)
+{
+	struct logger_segment *seg;
 
-	return count + get_user_hdr_len(reader->r_ver);
+	seg = kmalloc(sizeof(struct logger_segment), gfp);
+	if (!seg)
+		return NULL;
+
+	seg->data = kmalloc(LOGGER_SEGMENT_SIZE, gfp);
+	if (!seg->data) {
+		kfree(seg);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&seg->list);
+	seg->len = 0;
+	seg->clen = 0;
+	seg->users = 0;
+
+	return seg;
+}
+
+static void logger_free_segment(struct logger_segment *seg)
+{
+	kfree(seg->data);
+	kfree(seg);
+}
+
+/* a segment that was too incompressible is kept raw with clen == len */
+static inline bool segment_compressed(struct logger_segment *seg)
+{
+	return seg->clen && seg->clen < seg->len;
+}
+
+static inline size_t segment_bytes(struct logger_segment *seg)
+{
+	return segment_compressed(seg) ? seg->clen : LOGGER_SEGMENT_SIZE;
+}
+
+/*
+ * archive_trim - drops the oldest segments until the archive fits in
+ * 'budget' bytes.
+ *
+ * Caller must hold log->lock.
+ */
+static void archive_trim(struct logger_log *log, size_t budget)
+{
+	struct logger_segment *seg, *next;
+
+	list_for_each_entry_safe(seg, next, &log->segments, list) {
+		if (log->a_bytes <= budget)
+			break;
+		log->a_bytes -= segment_bytes(seg);
+		list_del_init(&seg->list);
+		if (!seg->users)
+			logger_free_segment(seg);
+	}
+}
+
+/*
+ * archive_seal - queues the full stage for compression.
+ *
+ * Caller must hold log->lock.
+ */
+static void archive_seal(struct logger_log *log)
+{
+	list_add_tail(&log->stage->list, &log->segments);
+	log->stage = NULL;
+	log->a_bytes += LOGGER_SEGMENT_SIZE;
+	archive_trim(log, logger_archive_kb << 10);
+	schedule_work(&log->work);
+}
+
+/*
+ * archive_evict - keeps the entries from offset 'off', at position 'pos',
+ * up to offset 'end' in the archive before the writer overwrites them.
+ *
+ * Caller must hold log->lock.
+ */
+static void archive_evict(struct logger_log *log, size_t off, size_t end,
+			  __u32 pos)
+{
+	struct logger_segment *stage;
+	size_t len;
+
+	if (!logger_archive_kb) {
+		/* the archive was turned off, give back all of its memory */
+		archive_trim(log, 0);
+		if (log->stage)
+			logger_free_segment(log->stage);
+		if (log->spare)
+			logger_free_segment(log->spare);
+		log->stage = NULL;
+		log->spare = NULL;
+		return;
+	}
+
+	for (; off != end; off = logger_offset(off + len), pos += len) {
+		len = sizeof(struct logger_entry) + get_entry_msg_len(log, off);
+
+		stage = log->stage;
+		if (stage && stage->len + len > LOGGER_SEGMENT_SIZE) {
+			archive_seal(log);
+			stage = NULL;
+		}
+
+		if (!stage) {
+			stage = log->spare;
+			log->spare = NULL;
+			if (!stage)
+				stage = logger_alloc_segment(GFP_ATOMIC);
+			if (!stage) {
+				log->stats.dropped++;
+				continue;
+			}
+			log->stage = stage;
+		}
+
+		if (!stage->len)
+			stage->start = pos;
+		do_read_log(log, off, stage->data + stage->len);
+		stage->len += len;
+	}
+}
+
+/*
+ * archive_first - returns the oldest segment holding entries, or NULL.
+ *
+ * Caller must hold log->lock.
+ */
+static struct logger_segment *archive_first(struct logger_log *log)
+{
+	if (!list_empty(&log->segments))
+		return list_first_entry(&log->segments, struct logger_segment,
+					list);
+	if (log->stage && log->stage->len)
+		return log->stage;
+	return NULL;
+}
+
+/* does 'seg' hold position '*pos'? Moves it past entries that were lost */
+static inline bool archive_holds(struct logger_segment *seg, __u32 *pos)
+{
+	if ((__s32) (*pos - seg->start) < 0)
+		*pos = seg->start;
+	return (__s32) (*pos - (seg->start + seg->len)) < 0;
+}
+
+/*
+ * archive_find - returns the segment holding the entry at '*pos', moving
+ * it forward to the oldest entry still kept, or NULL if the archive holds
+ * nothing from there on.
+ *
+ * Caller must hold log->lock.
+ */
+static struct logger_segment *archive_find(struct logger_log *log,
+					   __u32 *pos)
+{
+	struct logger_segment *seg;
+
+	list_for_each_entry(seg, &log->segments, list)
+		if (archive_holds(seg, pos))
+			return seg;
+
+	seg = log->stage;
+	if (seg && seg->len && archive_holds(seg, pos))
+		return seg;
+
+	return NULL;
+}
+
+/*
+ * archive_put - drops a reference on 'seg', freeing it if it was trimmed
+ *
+ * Caller must hold log->lock.
+ */
+static void archive_put(struct logger_segment *seg)
+{
+	if (!--seg->users && list_empty(&seg->list))
+		logger_free_segment(seg);
+}
+
+/*
+ * do_read_archived_entry - do_read_entry() for a reader in the archive.
+ * Compressed segments are decompressed, outside of log->lock, into the
+ * reader's a_buf. A reader that has caught up goes on in the ring.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t do_read_archived_entry(struct logger_reader *reader,
+				      char __user *buf, size_t count)
+{
+	struct logger_log *log = reader->log;
+	struct logger_segment *seg;
+	struct logger_entry *entry;
+	unsigned char *data;
+	size_t seg_len;
+	__u32 seg_start;
+	__u32 pos;
+	size_t len;
+	ssize_t ret;
+	u64 start;
+
+	if (!reader->a_buf) {
+		reader->a_buf = kmalloc(LOGGER_SEGMENT_SIZE, GFP_KERNEL);
+		if (!reader->a_buf)
+			return -ENOMEM;
+	}
+
+	spin_lock(&log->lock);
+again:
+	seg = reader->r_archived ? archive_find(log, &reader->a_pos) : NULL;
+	if (!seg) {
+		/* caught up, carry on with the oldest entry in the ring */
+		if (reader->r_archived) {
+			reader->r_archived = false;
+			reader->r_off = log->head;
+		}
+		spin_unlock(&log->lock);
+		return do_read_entry(reader, buf, count);
+	}
+
+	data = seg->data;
+	if (segment_compressed(seg)) {
+		if (!reader->a_len || reader->a_start != seg->start) {
+			seg_start = seg->start;
+			seg_len = seg->len;
+			seg->users++;
+			spin_unlock(&log->lock);
+
+			start = local_clock();
+			len = LOGGER_SEGMENT_SIZE;
+			ret = lzo1x_decompress_safe(seg->data, seg->clen,
+						    reader->a_buf, &len);
+
+			spin_lock(&log->lock);
+			log->stats.decompress_ns += local_clock() - start;
+			archive_put(seg);
+			if (ret != LZO_E_OK || len != seg_len) {
+				/*
+				 * Should not happen. Skip the whole segment,
+				 * wherever in it the reader was, or we would
+				 * decompress it again forever.
+				 */
+				reader->a_len = 0;
+				reader->a_pos = seg_start + seg_len;
+			} else {
+				reader->a_start = seg_start;
+				reader->a_len = len;
+			}
+			goto again;
+		}
+		data = reader->a_buf;
+	}
+
+	pos = reader->a_pos;
+	entry = (struct logger_entry *) reader->scratch;
+	memcpy(entry, data + (pos - seg->start), sizeof(struct logger_entry));
+	len = sizeof(struct logger_entry) + entry->len;
+
+	if (!reader->r_all && entry->euid != current_euid()) {
+		reader->a_pos = pos + len;
+		goto again;
+	}
+
+	ret = get_user_hdr_len(reader->r_ver) + entry->len;
+	if (count < ret) {
+		spin_unlock(&log->lock);
+		return -EINVAL;
+	}
+
+	memcpy(entry->msg, data + (pos - seg->start) +
+	       sizeof(struct logger_entry), entry->len);
+	spin_unlock(&log->lock);
+
+	ret = do_read_log_to_user(reader, buf);
+	if (ret < 0)
+		return ret;
+
+	spin_lock(&log->lock);
+	if (reader->r_archived && reader->a_pos == pos)
+		reader->a_pos = pos + len;
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/*
+ * logger_compress_work - compresses the sealed segments of a log, and
+ * allocates the next stage for the writers ahead of time.
+ */
+static void logger_compress_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log, work);
+	struct logger_segment *seg;
+	unsigned char *data;
+	bool found;
+	size_t clen;
+	u64 start;
+	u64 ns;
+	int ret;
+
+	seg = logger_alloc_segment(GFP_KERNEL);
+	spin_lock(&log->lock);
+	if (!log->spare) {
+		log->spare = seg;
+		seg = NULL;
+	}
+	spin_unlock(&log->lock);
+	if (seg)
+		logger_free_segment(seg);
+
+	mutex_lock(&logger_lzo_mutex);
+
+	if (!logger_lzo_wrkmem) {
+		logger_lzo_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		logger_lzo_dst =
+			vmalloc(lzo1x_worst_compress(LOGGER_SEGMENT_SIZE));
+		if (!logger_lzo_wrkmem || !logger_lzo_dst) {
+			vfree(logger_lzo_wrkmem);
+			vfree(logger_lzo_dst);
+			logger_lzo_wrkmem = NULL;
+			logger_lzo_dst = NULL;
+			goto out;
+		}
+	}
+
+	while (1) {
+		found = false;
+		spin_lock(&log->lock);
+		list_for_each_entry(seg, &log->segments, list) {
+			if (!seg->clen && !seg->users) {
+				seg->users++;
+				found = true;
+				break;
+			}
+		}
+		spin_unlock(&log->lock);
+		if (!found)
+			break;
+
+		/* the raw data of a segment does not change once sealed */
+		start = local_clock();
+		ret = lzo1x_1_compress(seg->data, seg->len, logger_lzo_dst,
+				       &clen, logger_lzo_wrkmem);
+		data = NULL;
+		if (ret == LZO_E_OK && clen < seg->len) {
+			data = kmalloc(clen, GFP_KERNEL);
+			if (data)
+				memcpy(data, logger_lzo_dst, clen);
+		}
+		ns = local_clock() - start;
+
+		spin_lock(&log->lock);
+		log->stats.compress_ns += ns;
+		if (list_empty(&seg->list)) {
+			/* trimmed while we were at it */
+			archive_put(seg);
+			spin_unlock(&log->lock);
+			kfree(data);
+			continue;
+		}
+		seg->users--;
+		log->stats.segments++;
+		log->stats.raw_bytes += seg->len;
+		if (data) {
+			swap(seg->data, data);
+			seg->clen = clen;
+			log->a_bytes -= LOGGER_SEGMENT_SIZE - clen;
+			log->stats.compressed_bytes += clen;
+		} else {
+			seg->clen = seg->len;
+			log->stats.compressed_bytes += seg->len;
+		}
+		spin_unlock(&log->lock);
+
+		/* now the raw copy, if the compressed one replaced it */
+		kfree(data);
+		cond_resched();
+	}
+
+out:
+	mutex_unlock(&logger_lzo_mutex);
 }
 
 /*
@@ -230,6 +692,71 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
 	return off;
 }
 
+/*
+ * do_read_entry - copies the reader's next entry to 'buf', which has room
+ * for 'count' bytes, and consumes it. Returns the number of bytes copied,
+ * zero if there is nothing to read, or -EINVAL if the entry does not fit.
+ *
+ * Caller must hold reader->mutex.
+ */
+static ssize_t do_read_entry(struct logger_reader *reader,
+			     char __user *buf, size_t count)
+{
+	struct logger_log *log = reader->log;
+	__u32 pos;
+	size_t off;
+	size_t len;
+	ssize_t ret;
+
+	spin_lock(&log->lock);
+
+	if (reader->r_archived) {
+		spin_unlock(&log->lock);
+		return do_read_archived_entry(reader, buf, count);
+	}
+
+	if (!reader->r_all)
+		reader->r_off = get_next_entry_by_uid(log,
+			reader->r_off, current_euid());
+
+	if (log->w_off == reader->r_off) {
+		spin_unlock(&log->lock);
+		return 0;
+	}
+
+	/* get the size of the next entry */
+	ret = get_user_hdr_len(reader->r_ver) +
+		get_entry_msg_len(log, reader->r_off);
+	if (count < ret) {
+		spin_unlock(&log->lock);
+		return -EINVAL;
+	}
+
+	/* get exactly one entry from the log */
+	off = reader->r_off;
+	pos = log->info->head + logger_offset(off - log->head);
+	len = do_read_log(log, off, reader->scratch);
+	spin_unlock(&log->lock);
+
+	ret = do_read_log_to_user(reader, buf);
+	if (ret < 0)
+		return ret;
+
+	/*
+	 * Consume it, unless a writer lapped us and moved us on meanwhile.
+	 * If that sent us to the archive, we go on after this entry there.
+	 */
+	spin_lock(&log->lock);
+	if (reader->r_archived) {
+		if (reader->a_pos == pos)
+			reader->a_pos = pos + len;
+	} else if (reader->r_off == off)
+		reader->r_off = logger_offset(off + len);
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -237,7 +764,8 @@ static size_t get_next_entry_by_uid(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or after LOGGER_SET_BATCH
+ * 	  as many whole entries as are available and fit in the buffer
  *
  * Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -247,16 +775,19 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	ssize_t copied;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
+	mutex_lock(&reader->mutex);
+
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_lock(&log->lock);
+		ret = !reader->r_archived && (log->w_off == reader->r_off);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -275,33 +806,27 @@ start:
 
 	finish_wait(&log->wq, &wait);
 	if (ret)
-		return ret;
-
-	mutex_lock(&log->mutex);
-
-	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+		goto out;
 
 	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+	ret = do_read_entry(reader, buf, count);
+	if (unlikely(!ret))
 		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
+	if (ret < 0 || !reader->r_batch)
 		goto out;
-	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/*
+	 * Keep going while whole entries are there and fit. Whatever stops
+	 * us, the entries already copied are what this read returns.
+	 */
+	copied = ret;
+	while ((ret = do_read_entry(reader, buf + copied,
+				    count - copied)) > 0)
+		copied += ret;
+	ret = copied;
 
 out:
-	mutex_unlock(&log->mutex);
+	mutex_unlock(&reader->mutex);
 
 	return ret;
 }
@@ -310,7 +835,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -347,28 +872,46 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry after the new write head. With the archive on, the entries the
+ * head moves over are archived and lapped readers go on reading there.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
 	size_t old = log->w_off;
 	size_t new = logger_offset(old + len);
+	size_t old_head = log->head;
+	__u32 old_pos = log->info->head;
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		archive_evict(log, old_head, head, old_pos);
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		/* mmap() readers must see the head move before the data */
+		log->info->head += logger_offset(head - old_head);
+		smp_wmb();
+		log->head = head;
+	}
+
+	list_for_each_entry(reader, &log->readers, list) {
+		if (!clock_interval(old, new, reader->r_off))
+			continue;
+		if (logger_archive_kb && !reader->r_archived) {
+			reader->r_archived = true;
+			reader->a_pos = old_pos +
+				logger_offset(reader->r_off - old_head);
+		}
+		reader->r_off = get_next_entry(log, reader->r_off, len);
+	}
 }
 
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -385,29 +928,54 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * do_stage_from_user - gathers 'count' bytes of the iovec 'iov' into 'buf'.
+ * With 'atomic' set page faults must be disabled, and a page that is not
+ * present fails the copy instead of being faulted in.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int do_stage_from_user(void *buf, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count, int atomic)
 {
-	size_t len;
+	while (count && nr_segs-- > 0) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len) ||
+			    __copy_from_user_inatomic(buf, iov->iov_base, len))
+				return -EFAULT;
+		} else if (copy_from_user(buf, iov->iov_base, len))
+			return -EFAULT;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+		buf += len;
+		count -= len;
+		iov++;
+	}
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	return 0;
+}
 
-	log->w_off = logger_offset(log->w_off + count);
+/*
+ * do_write_entry - appends the entry 'header' with the message 'msg' to 'log'
+ */
+static void do_write_entry(struct logger_log *log, struct logger_entry *header,
+			   const void *msg)
+{
+	spin_lock(&log->lock);
 
-	return count;
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, sizeof(struct logger_entry) + header->len);
+
+	do_write_log(log, header, sizeof(struct logger_entry));
+	do_write_log(log, msg, header->len);
+
+	smp_wmb();
+	log->info->tail += sizeof(struct logger_entry) + header->len;
+
+	spin_unlock(&log->lock);
 }
 
 /*
@@ -419,10 +987,10 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned char *msg;
+	int ret;
 
 	now = current_kernel_time();
 
@@ -438,43 +1006,30 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+	msg = get_cpu_var(logger_stage);
+	pagefault_disable();
+	ret = do_stage_from_user(msg, iov, nr_segs, header.len, 1);
+	pagefault_enable();
+	if (likely(!ret))
+		do_write_entry(log, &header, msg);
+	put_cpu_var(logger_stage);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
-
-		iov++;
-		ret += nr;
+	if (unlikely(ret)) {
+		msg = kmalloc(header.len, GFP_KERNEL);
+		if (!msg)
+			return -ENOMEM;
+		ret = do_stage_from_user(msg, iov, nr_segs, header.len, 0);
+		if (!ret)
+			do_write_entry(log, &header, msg);
+		kfree(msg);
+		if (ret)
+			return ret;
 	}
 
-	mutex_unlock(&log->mutex);
-
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
-	return ret;
+	return header.len;
 }
 
 static struct logger_log *get_log_from_minor(int);
@@ -504,17 +1059,30 @@ static int logger_open(struct inode *inode, struct file *file)
 		if (!reader)
 			return -ENOMEM;
 
+		reader->scratch = kmalloc(LOGGER_ENTRY_MAX_LEN, GFP_KERNEL);
+		if (!reader->scratch) {
+			kfree(reader);
+			return -ENOMEM;
+		}
+
 		reader->log = log;
+		mutex_init(&reader->mutex);
 		reader->r_ver = 1;
+		reader->r_batch = false;
+		reader->a_len = 0;
+		reader->a_buf = NULL;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
 
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
+		reader->r_archived = archive_first(log) != NULL;
+		if (reader->r_archived)
+			reader->a_pos = archive_first(log)->start;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -532,7 +1100,13 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		kfree(reader->a_buf);
+		kfree(reader->scratch);
 		kfree(reader);
 	}
 
@@ -562,18 +1136,63 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
 
-	if (log->w_off != reader->r_off)
+	if (reader->r_archived || log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the log's info page followed by the whole ring, read-only, for a
+ * reader that is allowed to see every entry. See struct logger_mmap_info
+ * for how to follow the log without racing the writers.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* The info page and the ring are one vmalloc_user() area */
+	return remap_vmalloc_range(vma, log->info, 0);
+}
+
+static long logger_set_batch(struct logger_reader *reader, void __user *arg)
+{
+	int batch;
+	if (copy_from_user(&batch, arg, sizeof(int)))
+		return -EFAULT;
+
+	mutex_lock(&reader->mutex);
+	reader->r_batch = !!batch;
+	mutex_unlock(&reader->mutex);
+	return 0;
+}
+
 static long logger_set_version(struct logger_reader *reader, void __user *arg)
 {
 	int version;
@@ -583,7 +1202,9 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	if ((version < 1) || (version > 2))
 		return -EINVAL;
 
+	mutex_lock(&reader->mutex);
 	reader->r_ver = version;
+	mutex_unlock(&reader->mutex);
 	return 0;
 }
 
@@ -594,7 +1215,21 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_SET_VERSION) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		reader = file->private_data;
+		return logger_set_version(reader, argp);
+	}
+
+	if (cmd == LOGGER_SET_BATCH) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		reader = file->private_data;
+		return logger_set_batch(reader, argp);
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -610,6 +1245,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = log->w_off - reader->r_off;
 		else
 			ret = (log->size - reader->r_off) + log->w_off;
+		if (reader->r_archived)
+			ret += log->info->head - reader->a_pos;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -618,6 +1255,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		}
 		reader = file->private_data;
 
+		/* only an upper bound while in the archive */
+		if (reader->r_archived) {
+			ret = get_user_hdr_len(reader->r_ver) +
+				LOGGER_ENTRY_MAX_PAYLOAD;
+			break;
+		}
+
 		if (!reader->r_all)
 			reader->r_off = get_next_entry_by_uid(log,
 				reader->r_off, current_euid());
@@ -633,9 +1277,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
+		list_for_each_entry(reader, &log->readers, list) {
 			reader->r_off = log->w_off;
+			reader->r_archived = false;
+		}
 		log->head = log->w_off;
+		log->info->head = log->info->tail;
+		archive_trim(log, 0);
+		if (log->stage)
+			log->stage->len = 0;
 		ret = 0;
 		break;
 	case LOGGER_GET_VERSION:
@@ -646,17 +1296,9 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
-	case LOGGER_SET_VERSION:
-		if (!(file->f_mode & FMODE_READ)) {
-			ret = -EBADF;
-			break;
-		}
-		reader = file->private_data;
-		ret = logger_set_version(reader, argp);
-		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -666,6 +1308,7 @@ static const struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -674,13 +1317,12 @@ static const struct file_operations logger_fops = {
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
- * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * must be a power of two, at least PAGE_SIZE, and greater than
+ * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)). The buffer is
+ * allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -689,10 +1331,12 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.segments = LIST_HEAD_INIT(VAR .segments), \
+	.work = __WORK_INITIALIZER(VAR .work, logger_compress_work), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -713,12 +1357,59 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static int logger_get_archive_stats(char *buffer, const struct kernel_param *kp)
+{
+	struct logger_log *logs[] = {
+		&log_main, &log_events, &log_radio, &log_system,
+	};
+	struct logger_archive_stats stats;
+	size_t a_bytes;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(logs); i++) {
+		spin_lock(&logs[i]->lock);
+		stats = logs[i]->stats;
+		a_bytes = logs[i]->a_bytes;
+		spin_unlock(&logs[i]->lock);
+
+		ret += scnprintf(buffer + ret, PAGE_SIZE - ret,
+			"%s: archive %zu bytes, %lu segments %llu -> %llu "
+			"bytes (%llu%%), compress %llu us, decompress %llu us, "
+			"dropped %lu\n", logs[i]->misc.name, a_bytes,
+			stats.segments, stats.raw_bytes,
+			stats.compressed_bytes,
+			stats.raw_bytes ? div64_u64(stats.compressed_bytes *
+						    100, stats.raw_bytes) : 0,
+			div_u64(stats.compress_ns, NSEC_PER_USEC),
+			div_u64(stats.decompress_ns, NSEC_PER_USEC),
+			stats.dropped);
+	}
+
+	return ret;
+}
+module_param_call(archive_stats, NULL, logger_get_archive_stats, NULL,
+	S_IRUGO);
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/*
+	 * The info page is followed by the ring so that logger_mmap() can map
+	 * both with remap_vmalloc_range(). A static array would not do, as a
+	 * module's data is itself in vmalloc space and has no linear address.
+	 */
+	log->info = vmalloc_user(PAGE_SIZE + log->size);
+	if (unlikely(!log->info))
+		return -ENOMEM;
+	log->buffer = (unsigned char *) log->info + PAGE_SIZE;
+	log->info->version = LOGGER_MMAP_VERSION;
+	log->info->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
+		vfree(log->info);
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
 		return ret;
@@ -58,6 +58,26 @@ struct logger_entry {
 
 #define LOGGER_ENTRY_MAX_PAYLOAD	4076
 
+/*
+ * The first page of a log mapped with mmap(); the ring of entries follows
+ * it. 'head' and 'tail' are positions, in bytes written since boot and
+ * wrapping at 2^32: the entry at position p starts at (p & (size - 1))
+ * in the ring, and the entries from 'head' up to 'tail' are valid.
+ *
+ * A reader at position p reads 'tail', then the entries up to it, then
+ * 'head' again, with read barriers in between. If 'head' has moved past
+ * p, the writer may have overwritten what was read, which must be thrown
+ * away and read again from 'head'.
+ */
+struct logger_mmap_info {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		size;		/* size of the ring */
+	__u32		head;		/* position of the oldest entry */
+	__u32		tail;		/* position the next entry goes to */
+};
+
+#define LOGGER_MMAP_VERSION	1
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
@@ -66,5 +86,6 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_BATCH		_IO(__LOGGERIO, 7) /* entries per read */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,24 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Rather than walking every process each time the shrinker runs, the driver
+ * keeps the thread group leaders on lists indexed by oom_adj, maintained on
+ * fork, exec, exit and oom_adj writes, and only looks at the highest ones.
+ * Set /sys/module/lowmemorykiller/parameters/full_scan to go back to the
+ * full walk; scan_stats shows the cost of either.
+ *
+ * The driver also turns the reclaim efficiency seen by mm/vmscan.c into a
+ * memory pressure level, so that user space can trim caches and kill before
+ * the shrinker has to. Pressure is the percentage of the pages scanned that
+ * could not be reclaimed, over windows of pressure_window pages. It is
+ * "medium" from pressure_medium and "critical" from pressure_critical on,
+ * or when direct reclaim gets down to a priority of pressure_critical_prio.
+ * A level only drops once the pressure is pressure_hysteresis below its
+ * threshold, and it decays back to "low" when no reclaim has been seen for
+ * pressure_decay_ms. /dev/lowmem_pressure reads as "<level> <pressure>\n";
+ * the first read returns at once, later ones block until the level changes,
+ * and poll() reports when it has.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +53,16 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/spinlock.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/timer.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +83,52 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/* one list of thread group leaders per oom_adj value */
+#define LOWMEM_ADJ_LEVELS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_SCAN_BATCH	32
+
+static struct list_head lowmem_adj_lists[LOWMEM_ADJ_LEVELS];
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+
+static int lowmem_full_scan;
+
+/* updated racily, the shrinker can run on several CPUs at once */
+struct lowmem_scan_stats {
+	unsigned long scans;	/* shrinker calls that looked for a victim */
+	unsigned long tasks;	/* tasks examined by them */
+	u64 ns;			/* time they took */
+	u64 max_ns;
+};
+static struct lowmem_scan_stats lowmem_scan_stats[2];
+
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	"low",
+	"medium",
+	"critical",
+};
+
+static unsigned int lowmem_pressure_window = SWAP_CLUSTER_MAX * 16;
+static unsigned int lowmem_pressure_medium = 60;
+static unsigned int lowmem_pressure_critical = 95;
+static unsigned int lowmem_pressure_hysteresis = 10;
+static int lowmem_pressure_critical_prio = 3;
+static unsigned int lowmem_pressure_decay_ms = 1000;
+
+/* protected by lowmem_pressure_lock, which the decay timer takes too */
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static unsigned long lowmem_pressure_scanned;
+static unsigned long lowmem_pressure_reclaimed;
+static enum lowmem_pressure_level lowmem_pressure_level;
+static unsigned int lowmem_pressure;
+static unsigned long lowmem_pressure_seq;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,16 +153,229 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static inline int lowmem_adj_to_idx(int oom_adj)
+{
+	return clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX) - OOM_DISABLE;
+}
+
+static struct list_head *lowmem_adj_list(int idx)
+{
+	struct list_head *list = &lowmem_adj_lists[idx];
+
+	/* filled in on first use, this may run before any initcall */
+	if (unlikely(!list->next))
+		INIT_LIST_HEAD(list);
+	return list;
+}
+
+/*
+ * The index hooks below are called by fork, exec and exit with tasklist_lock
+ * held for writing, which may be taken from interrupts, so lowmem_adj_lock
+ * must be taken with interrupts off. Nothing else is taken under it.
+ */
+void lowmem_adj_index_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	p->lowmem_adj_idx = lowmem_adj_to_idx(p->signal->oom_adj);
+	list_add_tail(&p->lowmem_adj_node, lowmem_adj_list(p->lowmem_adj_idx));
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+void lowmem_adj_index_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	list_del_init(&p->lowmem_adj_node);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* 'new' takes over as thread group leader from 'old' in exec */
+void lowmem_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	new->lowmem_adj_idx = old->lowmem_adj_idx;
+	list_replace_init(&old->lowmem_adj_node, &new->lowmem_adj_node);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* refiles the thread group of 'p' after its oom_adj was written */
+void lowmem_adj_index_update(struct task_struct *p)
+{
+	unsigned long flags;
+	int idx;
+
+	rcu_read_lock();
+	p = p->group_leader;
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	idx = lowmem_adj_to_idx(p->signal->oom_adj);
+	if (!list_empty(&p->lowmem_adj_node) && idx != p->lowmem_adj_idx) {
+		p->lowmem_adj_idx = idx;
+		list_move_tail(&p->lowmem_adj_node, lowmem_adj_list(idx));
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	rcu_read_unlock();
+}
+
+/*
+ * lowmem_task_size - the rss of 'p', or 0 if it has no mm or an oom_adj
+ * below 'min_adj'. Its oom_adj is returned in '*oom_adj'.
+ */
+static int lowmem_task_size(struct task_struct *p, int min_adj, int *oom_adj)
+{
+	int tasksize = 0;
+
+	task_lock(p);
+	if (p->mm && p->signal) {
+		*oom_adj = p->signal->oom_adj;
+		if (*oom_adj >= min_adj)
+			tasksize = get_mm_rss(p->mm);
+	}
+	task_unlock(p);
+
+	return tasksize;
+}
+
+/*
+ * lowmem_select_indexed - picks the largest task in the highest non-empty
+ * oom_adj list at or above 'min_adj'. The tasks are taken off the list in
+ * batches, with a reference, so that task_lock() is never nested inside
+ * lowmem_adj_lock. Returns the victim with a reference held.
+ */
+static struct task_struct *lowmem_select_indexed(int min_adj, int *sizep,
+						 int *adjp, int *scanned)
+{
+	struct task_struct *batch[LOWMEM_SCAN_BATCH];
+	struct task_struct *selected = NULL;
+	struct task_struct *p;
+	int selected_tasksize = 0;
+	int tasksize;
+	int oom_adj;
+	int taken;
+	int skip;
+	int idx;
+	int i;
+	int n;
+
+	for (idx = LOWMEM_ADJ_LEVELS - 1;
+	     idx >= lowmem_adj_to_idx(min_adj) && !selected; idx--) {
+		taken = 0;
+		do {
+			n = 0;
+			skip = taken;
+			spin_lock_irq(&lowmem_adj_lock);
+			list_for_each_entry(p, lowmem_adj_list(idx),
+					    lowmem_adj_node) {
+				if (skip-- > 0)
+					continue;
+				get_task_struct(p);
+				batch[n++] = p;
+				if (n == LOWMEM_SCAN_BATCH)
+					break;
+			}
+			spin_unlock_irq(&lowmem_adj_lock);
+			taken += n;
+			*scanned += n;
+
+			for (i = 0; i < n; i++) {
+				p = batch[i];
+				tasksize = lowmem_task_size(p, min_adj,
+							    &oom_adj);
+				if (tasksize <= 0 ||
+				    tasksize <= selected_tasksize) {
+					put_task_struct(p);
+					continue;
+				}
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				selected_tasksize = tasksize;
+				*adjp = oom_adj;
+				lowmem_print(2, "select %d (%s), adj %d, "
+					     "size %d, to kill\n", p->pid,
+					     p->comm, oom_adj, tasksize);
+			}
+		} while (n == LOWMEM_SCAN_BATCH);
+	}
+
+	*sizep = selected_tasksize;
+	return selected;
+}
+
+/*
+ * lowmem_select_full - the same choice by walking every process, as this
+ * driver used to. Returns the victim with a reference held.
+ */
+static struct task_struct *lowmem_select_full(int min_adj, int *sizep,
+					      int *adjp, int *scanned)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
+	int selected_tasksize = 0;
+	int selected_oom_adj = min_adj;
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		struct mm_struct *mm;
+		struct signal_struct *sig;
+		int oom_adj;
+
+		(*scanned)++;
+		task_lock(p);
+		mm = p->mm;
+		sig = p->signal;
+		if (!mm || !sig) {
+			task_unlock(p);
+			continue;
+		}
+		oom_adj = sig->oom_adj;
+		if (oom_adj < min_adj) {
+			task_unlock(p);
+			continue;
+		}
+		tasksize = get_mm_rss(mm);
+		task_unlock(p);
+		if (tasksize <= 0)
+			continue;
+		if (selected) {
+			if (oom_adj < selected_oom_adj)
+				continue;
+			if (oom_adj == selected_oom_adj &&
+			    tasksize <= selected_tasksize)
+				continue;
+		}
+		selected = p;
+		selected_tasksize = tasksize;
+		selected_oom_adj = oom_adj;
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     p->pid, p->comm, oom_adj, tasksize);
+	}
+	if (selected)
+		get_task_struct(selected);
+	read_unlock(&tasklist_lock);
+
+	*sizep = selected_tasksize;
+	*adjp = selected_oom_adj;
+	return selected;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *selected;
+	struct lowmem_scan_stats *stats;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int selected_oom_adj = 0;
+	int scanned = 0;
+	u64 start;
+	u64 ns;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
@@ -129,58 +416,227 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
+	start = local_clock();
+	if (lowmem_full_scan)
+		selected = lowmem_select_full(min_adj, &selected_tasksize,
+					      &selected_oom_adj, &scanned);
+	else
+		selected = lowmem_select_indexed(min_adj, &selected_tasksize,
+						 &selected_oom_adj, &scanned);
+	ns = local_clock() - start;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
+	stats = &lowmem_scan_stats[!!lowmem_full_scan];
+	stats->scans++;
+	stats->tasks += scanned;
+	stats->ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	lowmem_print(3, "lowmem_shrink scanned %d tasks in %llu ns\n",
+		     scanned, ns);
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
+		send_sig(SIGKILL, selected, 0);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+static enum lowmem_pressure_level lowmem_pressure_to_level(unsigned int p)
+{
+	if (p >= lowmem_pressure_critical)
+		return LOWMEM_PRESSURE_CRITICAL;
+	if (p >= lowmem_pressure_medium)
+		return LOWMEM_PRESSURE_MEDIUM;
+	return LOWMEM_PRESSURE_LOW;
+}
+
+/*
+ * lowmem_pressure_set - moves to 'level' and wakes up the readers if that
+ * is a change. Caller must hold lowmem_pressure_lock.
+ */
+static void lowmem_pressure_set(enum lowmem_pressure_level level,
+				unsigned int pressure)
+{
+	lowmem_pressure = pressure;
+	if (level == lowmem_pressure_level)
+		return;
+
+	lowmem_print(3, "lowmem pressure %s -> %s (%u)\n",
+		     lowmem_pressure_names[lowmem_pressure_level],
+		     lowmem_pressure_names[level], pressure);
+	lowmem_pressure_level = level;
+	lowmem_pressure_seq++;
+	wake_up_interruptible(&lowmem_pressure_wait);
+}
+
+static void lowmem_pressure_decay(unsigned long data)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_pressure_lock, flags);
+	lowmem_pressure_scanned = 0;
+	lowmem_pressure_reclaimed = 0;
+	lowmem_pressure_set(LOWMEM_PRESSURE_LOW, 0);
+	spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+}
+
+static DEFINE_TIMER(lowmem_pressure_timer, lowmem_pressure_decay, 0, 0);
+
+/*
+ * lowmem_vmpressure - accounts 'scanned' pages, of which 'reclaimed' were
+ * freed, to the pressure window, and computes the level when it is full.
+ * Called by shrink_zone() for global reclaim.
+ */
+void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+		       unsigned long reclaimed)
+{
+	enum lowmem_pressure_level level;
+	unsigned int pressure;
+	unsigned long flags;
+
+	/* only allocations for user space tell us about its memory */
+	if (!(gfp & (__GFP_HIGHMEM | __GFP_MOVABLE | __GFP_IO | __GFP_FS)))
+		return;
+	if (!scanned)
+		return;
+
+	spin_lock_irqsave(&lowmem_pressure_lock, flags);
+
+	lowmem_pressure_scanned += scanned;
+	lowmem_pressure_reclaimed += reclaimed;
+	if (lowmem_pressure_scanned < lowmem_pressure_window)
+		goto out;
+
+	scanned = lowmem_pressure_scanned;
+	reclaimed = min(lowmem_pressure_reclaimed, scanned);
+	lowmem_pressure_scanned = 0;
+	lowmem_pressure_reclaimed = 0;
+
+	pressure = (scanned - reclaimed) * 100 / scanned;
+	level = lowmem_pressure_to_level(pressure);
+	if (level < lowmem_pressure_level)
+		level = max(level, lowmem_pressure_to_level(pressure +
+					lowmem_pressure_hysteresis));
+	lowmem_pressure_set(level, pressure);
+
+	if (lowmem_pressure_level != LOWMEM_PRESSURE_LOW)
+		mod_timer(&lowmem_pressure_timer, jiffies +
+			  msecs_to_jiffies(lowmem_pressure_decay_ms));
+out:
+	spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+}
+
+/*
+ * lowmem_vmpressure_prio - called by direct reclaim at each 'priority' it
+ * goes through. Getting down to pressure_critical_prio means the scans at
+ * the earlier priorities did not free enough, which counts as a full window
+ * with nothing reclaimed.
+ */
+void lowmem_vmpressure_prio(gfp_t gfp, int priority)
+{
+	if (priority > lowmem_pressure_critical_prio)
+		return;
+
+	lowmem_vmpressure(gfp, lowmem_pressure_window, 0);
+}
+
+/* the last event a reader has seen */
+struct lowmem_pressure_reader {
+	unsigned long seq;
+};
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	struct lowmem_pressure_reader *reader;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	/* the first read returns the current level straight away */
+	spin_lock_irq(&lowmem_pressure_lock);
+	reader->seq = lowmem_pressure_seq - 1;
+	spin_unlock_irq(&lowmem_pressure_lock);
+
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_pressure_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+	enum lowmem_pressure_level level;
+	unsigned int pressure;
+	char tmp[32];
+	int ret;
+
+	spin_lock_irq(&lowmem_pressure_lock);
+	while (reader->seq == lowmem_pressure_seq) {
+		spin_unlock_irq(&lowmem_pressure_lock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_pressure_wait,
+				reader->seq != ACCESS_ONCE(lowmem_pressure_seq));
+		if (ret)
+			return ret;
+		spin_lock_irq(&lowmem_pressure_lock);
+	}
+	reader->seq = lowmem_pressure_seq;
+	level = lowmem_pressure_level;
+	pressure = lowmem_pressure;
+	spin_unlock_irq(&lowmem_pressure_lock);
+
+	ret = scnprintf(tmp, sizeof(tmp), "%s %u\n",
+			lowmem_pressure_names[level], pressure);
+	if (count < ret)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, ret))
+		return -EFAULT;
+
+	return ret;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	struct lowmem_pressure_reader *reader = file->private_data;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	if (reader->seq != ACCESS_ONCE(lowmem_pressure_seq))
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.release = lowmem_pressure_release,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -188,6 +644,11 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_pressure_misc);
+	if (ret)
+		return ret;
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -197,6 +658,8 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	misc_deregister(&lowmem_pressure_misc);
+	del_timer_sync(&lowmem_pressure_timer);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,6 +668,39 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(full_scan, lowmem_full_scan, int, S_IRUGO | S_IWUSR);
+module_param_named(pressure_window, lowmem_pressure_window, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_hysteresis, lowmem_pressure_hysteresis, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical_prio, lowmem_pressure_critical_prio, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_decay_ms, lowmem_pressure_decay_ms, uint,
+		   S_IRUGO | S_IWUSR);
+
+static int lowmem_get_scan_stats(char *buffer, const struct kernel_param *kp)
+{
+	static const char *name[] = { "indexed", "full" };
+	struct lowmem_scan_stats stats;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(lowmem_scan_stats); i++) {
+		stats = lowmem_scan_stats[i];
+		ret += scnprintf(buffer + ret, PAGE_SIZE - ret,
+			"%s: %lu scans, %lu tasks, avg %llu ns, max %llu ns\n",
+			name[i], stats.scans, stats.tasks,
+			stats.scans ? div64_u64(stats.ns, stats.scans) : 0,
+			stats.max_ns);
+	}
+
+	return ret;
+}
+module_param_call(scan_stats, NULL, lowmem_get_scan_stats, NULL, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,290 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/lzo.h>
+#ifdef CONFIG_ZRAM_LZ4
+#include <linux/lz4.h>
+#endif
+
+#include "zram_comp.h"
+
+static int zram_lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem)
+{
+	int ret;
+
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+
+	return ret == LZO_E_OK ? 0 : ret;
+}
+
+static int zram_lzo_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	int ret;
+	size_t dst_len = PAGE_SIZE;
+
+	ret = lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+	if (ret != LZO_E_OK)
+		return ret;
+
+	return dst_len == PAGE_SIZE ? 0 : LZO_E_ERROR;
+}
+
+static struct zram_comp zram_comp_lzo = {
+	.name		= "lzo",
+	.workmem_size	= LZO1X_MEM_COMPRESS,
+	.compress	= zram_lzo_compress,
+	.decompress	= zram_lzo_decompress,
+};
+
+#ifdef CONFIG_ZRAM_LZ4
+static int zram_lz4_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem)
+{
+	return lz4_compress(src, PAGE_SIZE, dst, dst_len, workmem);
+}
+
+static int zram_lz4_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	int ret;
+	size_t dst_len = PAGE_SIZE;
+
+	ret = lz4_decompress_unknownoutputsize(src, src_len, dst, &dst_len);
+	if (ret != LZ4_E_OK)
+		return ret;
+
+	return dst_len == PAGE_SIZE ? 0 : LZ4_E_ERROR;
+}
+
+static struct zram_comp zram_comp_lz4 = {
+	.name		= "lz4",
+	.workmem_size	= LZ4_MEM_COMPRESS,
+	.compress	= zram_lz4_compress,
+	.decompress	= zram_lz4_decompress,
+};
+#endif
+
+static struct zram_comp *backends[] = {
+	&zram_comp_lzo,
+#ifdef CONFIG_ZRAM_LZ4
+	&zram_comp_lz4,
+#endif
+};
+
+struct zram_comp *zram_comp_default = &zram_comp_lzo;
+
+struct zram_comp *zram_comp_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		if (sysfs_streq(name, backends[i]->name))
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+ssize_t zram_comp_show_available(struct zram_comp *cur, char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		if (backends[i] == cur)
+			sz += sprintf(buf + sz, "[%s] ", backends[i]->name);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]->name);
+	}
+	buf[sz - 1] = '\n';
+
+	return sz;
+}
+
+ssize_t zram_comp_show_stats(char *buf)
+{
+	int i;
+	ssize_t sz = 0;
+
+	sz += sprintf(buf, "%-6s %12s %12s %14s %14s %12s %12s\n",
+			"algo", "compress", "comp_ns", "bytes_in",
+			"bytes_out", "decompress", "decomp_ns");
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		struct zram_comp_stats *s = &backends[i]->stats;
+
+		sz += sprintf(buf + sz,
+			"%-6s %12llu %12llu %14llu %14llu %12llu %12llu\n",
+			backends[i]->name,
+			(u64)atomic64_read(&s->num_compress),
+			(u64)atomic64_read(&s->compress_ns),
+			(u64)atomic64_read(&s->bytes_in),
+			(u64)atomic64_read(&s->bytes_out),
+			(u64)atomic64_read(&s->num_decompress),
+			(u64)atomic64_read(&s->decompress_ns));
+	}
+
+	return sz;
+}
+
+static void zram_strm_free(struct zram_comp_strm *strm)
+{
+	kfree(strm->workmem);
+	free_pages((unsigned long)strm->buffer, ZRAM_COMP_BUF_ORDER);
+	kfree(strm);
+}
+
+static struct zram_comp_strm *zram_strm_alloc(struct zram_comp *comp)
+{
+	struct zram_comp_strm *strm;
+
+	strm = kzalloc(sizeof(*strm), GFP_KERNEL);
+	if (!strm)
+		return NULL;
+
+	strm->workmem = kzalloc(comp->workmem_size, GFP_KERNEL);
+	strm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+						ZRAM_COMP_BUF_ORDER);
+	if (!strm->workmem || !strm->buffer) {
+		zram_strm_free(strm);
+		return NULL;
+	}
+
+	return strm;
+}
+
+int zram_strm_pool_create(struct zram_strm_pool *pool,
+			struct zram_comp *comp, int max_strm)
+{
+	int i;
+
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->idle);
+	init_waitqueue_head(&pool->wait);
+	pool->max_strm = 0;
+	pool->num_acquire = 0;
+	pool->num_waits = 0;
+	pool->wait_ns = 0;
+
+	for (i = 0; i < max_strm; i++) {
+		struct zram_comp_strm *strm = zram_strm_alloc(comp);
+
+		if (!strm) {
+			zram_strm_pool_destroy(pool);
+			return -ENOMEM;
+		}
+		list_add(&strm->list, &pool->idle);
+		pool->max_strm++;
+	}
+
+	return 0;
+}
+
+/* All streams must have been released */
+void zram_strm_pool_destroy(struct zram_strm_pool *pool)
+{
+	struct zram_comp_strm *strm, *tmp;
+
+	list_for_each_entry_safe(strm, tmp, &pool->idle, list) {
+		list_del(&strm->list);
+		zram_strm_free(strm);
+	}
+	pool->max_strm = 0;
+}
+
+static struct zram_comp_strm *zram_strm_get_idle(struct zram_strm_pool *pool)
+{
+	struct zram_comp_strm *strm = NULL;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->idle)) {
+		strm = list_first_entry(&pool->idle,
+				struct zram_comp_strm, list);
+		list_del(&strm->list);
+		pool->num_acquire++;
+	}
+	spin_unlock(&pool->lock);
+
+	return strm;
+}
+
+/* Get an idle stream, sleeping until one is released if necessary */
+struct zram_comp_strm *zram_strm_find(struct zram_strm_pool *pool)
+{
+	u64 start;
+	struct zram_comp_strm *strm;
+
+	strm = zram_strm_get_idle(pool);
+	if (likely(strm))
+		return strm;
+
+	start = local_clock();
+	wait_event(pool->wait, (strm = zram_strm_get_idle(pool)) != NULL);
+
+	spin_lock(&pool->lock);
+	pool->num_waits++;
+	pool->wait_ns += local_clock() - start;
+	spin_unlock(&pool->lock);
+
+	return strm;
+}
+
+void zram_strm_release(struct zram_strm_pool *pool,
+			struct zram_comp_strm *strm)
+{
+	spin_lock(&pool->lock);
+	list_add(&strm->list, &pool->idle);
+	spin_unlock(&pool->lock);
+
+	wake_up(&pool->wait);
+}
+
+int zram_comp_compress(struct zram_comp *comp, const unsigned char *src,
+			unsigned char *dst, size_t *dst_len, void *workmem)
+{
+	int ret;
+	u64 start = local_clock();
+
+	ret = comp->compress(src, dst, dst_len, workmem);
+
+	atomic64_add(local_clock() - start, &comp->stats.compress_ns);
+	atomic64_inc(&comp->stats.num_compress);
+	if (!ret) {
+		atomic64_add(PAGE_SIZE, &comp->stats.bytes_in);
+		atomic64_add(*dst_len, &comp->stats.bytes_out);
+	}
+
+	return ret;
+}
+
+int zram_comp_decompress(struct zram_comp *comp, const unsigned char *src,
+			size_t src_len, unsigned char *dst)
+{
+	int ret;
+	u64 start = local_clock();
+
+	ret = comp->decompress(src, src_len, dst);
+
+	atomic64_add(local_clock() - start, &comp->stats.decompress_ns);
+	atomic64_inc(&comp->stats.num_decompress);
+
+	return ret;
+}
@@ -0,0 +1,102 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_COMP_H_
+#define _ZRAM_COMP_H_
+
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * Per-algorithm counters. These are shared by all zram devices and
+ * survive a device reset, so the same workload can be replayed with
+ * each backend and the numbers compared side by side.
+ */
+struct zram_comp_stats {
+	atomic64_t num_compress;
+	atomic64_t compress_ns;		/* time spent in ->compress() */
+	atomic64_t bytes_in;		/* uncompressed bytes consumed */
+	atomic64_t bytes_out;		/* compressed bytes produced */
+	atomic64_t num_decompress;
+	atomic64_t decompress_ns;	/* time spent in ->decompress() */
+};
+
+/* Compression backend */
+struct zram_comp {
+	const char *name;
+	size_t workmem_size;
+
+	/*
+	 * Compress one page from src into dst. dst is at least
+	 * ZRAM_COMP_BUF_SIZE bytes, which covers the worst case
+	 * expansion of every backend.
+	 */
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *workmem);
+
+	/* Decompress src into dst, which must come out as one full page */
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+
+	struct zram_comp_stats stats;
+};
+
+/* Size of a stream's compress buffer: two pages */
+#define ZRAM_COMP_BUF_ORDER	1
+#define ZRAM_COMP_BUF_SIZE	(PAGE_SIZE << ZRAM_COMP_BUF_ORDER)
+
+/* Working memory for one in-flight compression */
+struct zram_comp_strm {
+	void *workmem;
+	void *buffer;		/* ZRAM_COMP_BUF_SIZE bytes */
+	struct list_head list;
+};
+
+/*
+ * Pool of compression streams. Writers grab an idle stream and only
+ * block when all of them are busy, so up to max_strm pages can be
+ * compressed concurrently.
+ */
+struct zram_strm_pool {
+	spinlock_t lock;	/* protects idle list and stats below */
+	struct list_head idle;
+	wait_queue_head_t wait;
+	int max_strm;
+
+	u64 num_acquire;	/* streams handed out */
+	u64 num_waits;		/* acquisitions that had to sleep */
+	u64 wait_ns;		/* total time slept waiting for a stream */
+};
+
+extern struct zram_comp *zram_comp_default;
+
+struct zram_comp *zram_comp_find(const char *name);
+ssize_t zram_comp_show_available(struct zram_comp *cur, char *buf);
+ssize_t zram_comp_show_stats(char *buf);
+
+int zram_strm_pool_create(struct zram_strm_pool *pool,
+			struct zram_comp *comp, int max_strm);
+void zram_strm_pool_destroy(struct zram_strm_pool *pool);
+struct zram_comp_strm *zram_strm_find(struct zram_strm_pool *pool);
+void zram_strm_release(struct zram_strm_pool *pool,
+			struct zram_comp_strm *strm);
+
+int zram_comp_compress(struct zram_comp *comp, const unsigned char *src,
+			unsigned char *dst, size_t *dst_len, void *workmem);
+int zram_comp_decompress(struct zram_comp *comp, const unsigned char *src,
+			size_t src_len, unsigned char *dst);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+/*
+ * Deduplication of identical pages. The compressors are deterministic,
+ * so byte-identical pages compress to byte-identical objects: it is
+ * enough to hash and compare the (much smaller) compressed data, and a
+ * duplicate never needs to be decompressed to be recognised.
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+u32 zram_dedup_checksum(const unsigned char *cmem, size_t len)
+{
+	return jhash(cmem, len, 0);
+}
+
+static bool zram_dedup_match(struct zram *zram,
+			struct zram_dedup_entry *entry,
+			const unsigned char *cmem, size_t len)
+{
+	bool match;
+	unsigned char *obj;
+
+	if (entry->size != len)
+		return false;
+
+	obj = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(obj, cmem, len);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Look for a stored object identical to cmem and take a reference to
+ * it. Returns NULL if there is none.
+ */
+struct zram_dedup_entry *zram_dedup_get(struct zram *zram,
+			const unsigned char *cmem, size_t len, u32 checksum)
+{
+	struct rb_node *node, *prev;
+	struct zram_dedup_entry *entry, *found = NULL;
+
+	spin_lock(&zram->dedup_lock);
+
+	node = zram->dedup_root.rb_node;
+	while (node) {
+		entry = rb_entry(node, struct zram_dedup_entry, node);
+		if (checksum < entry->checksum)
+			node = node->rb_left;
+		else if (checksum > entry->checksum)
+			node = node->rb_right;
+		else
+			break;
+	}
+
+	/* Checksums may collide: try every entry that shares this one */
+	while (node && (prev = rb_prev(node)) &&
+	       rb_entry(prev, struct zram_dedup_entry, node)->checksum ==
+			checksum)
+		node = prev;
+
+	for (; node; node = rb_next(node)) {
+		entry = rb_entry(node, struct zram_dedup_entry, node);
+		if (entry->checksum != checksum)
+			break;
+		if (zram_dedup_match(zram, entry, cmem, len)) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+
+	spin_unlock(&zram->dedup_lock);
+
+	return found;
+}
+
+/* Make a freshly stored object available for sharing */
+struct zram_dedup_entry *zram_dedup_new(struct zram *zram,
+			unsigned long handle, size_t len, u32 checksum)
+{
+	struct rb_node **link, *parent = NULL;
+	struct zram_dedup_entry *entry, *new;
+
+	new = kmalloc(sizeof(*new), GFP_NOIO);
+	if (!new)
+		return NULL;
+
+	new->checksum = checksum;
+	new->size = len;
+	new->refcount = 1;
+	new->handle = handle;
+
+	spin_lock(&zram->dedup_lock);
+
+	link = &zram->dedup_root.rb_node;
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct zram_dedup_entry, node);
+		if (checksum < entry->checksum)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &zram->dedup_root);
+
+	spin_unlock(&zram->dedup_lock);
+
+	return new;
+}
+
+/*
+ * Drop a reference. Returns true if it was the last one, in which case
+ * the object has been freed along with the entry.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry)
+{
+	bool last;
+
+	spin_lock(&zram->dedup_lock);
+	last = !--entry->refcount;
+	if (last)
+		rb_erase(&entry->node, &zram->dedup_root);
+	spin_unlock(&zram->dedup_lock);
+
+	if (last) {
+		zs_free(zram->mem_pool, entry->handle);
+		kfree(entry);
+	}
+
+	return last;
+}
@@ -0,0 +1,42 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/rbtree.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * A compressed object that may be shared by several table entries.
+ * Entries flagged ZRAM_DEDUP point here instead of at the object.
+ */
+struct zram_dedup_entry {
+	struct rb_node node;	/* in zram->dedup_root, keyed by checksum */
+	u32 checksum;		/* of the compressed data */
+	u16 size;		/* compressed size */
+	unsigned int refcount;	/* table entries using this object */
+	unsigned long handle;
+};
+
+u32 zram_dedup_checksum(const unsigned char *cmem, size_t len);
+struct zram_dedup_entry *zram_dedup_get(struct zram *zram,
+			const unsigned char *cmem, size_t len, u32 checksum);
+struct zram_dedup_entry *zram_dedup_new(struct zram *zram,
+			unsigned long handle, size_t len, u32 checksum);
+bool zram_dedup_put(struct zram *zram, struct zram_dedup_entry *entry);
+
+#endif
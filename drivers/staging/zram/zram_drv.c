@@ -26,12 +26,15 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -89,21 +92,55 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Take zram->lock, accounting the time spent waiting for it so that
+ * contention between concurrent writers shows up in sysfs.
+ */
+static void zram_lock_table(struct zram *zram)
+{
+	u64 start;
+
+	if (mutex_trylock(&zram->lock))
+		return;
+
+	start = local_clock();
+	mutex_lock(&zram->lock);
+	zram_stat64_inc(zram, &zram->stats.lock_waits);
+	zram_stat64_add(zram, &zram->stats.lock_wait_ns,
+			local_clock() - start);
+}
+
+/*
+ * Check whether the page is one word repeated throughout; zero filled
+ * pages are the most common case of this.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+/* zsmalloc handle of the object backing a table entry */
+static unsigned long zram_get_handle(struct zram *zram, u32 index)
+{
+	unsigned long handle = zram->table[index].handle;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		handle = ((struct zram_dedup_entry *)handle)->handle;
+
+	return handle;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,15 +170,33 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
-static void zram_free_page(struct zram *zram, size_t index)
+/* Release whatever backs a table entry. Caller holds table_lock. */
+static void __zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+	u16 clen = zram->table[index].size;
+
+	/* Tells a writeback in progress that the slot has changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		clear_bit(handle, zram->wb_bitmap);
+		zram_stat_dec(&zram->stats.pages_wb);
+		zram->table[index].handle = 0;
+		return;
+	}
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Same filled pages keep their pattern in place of a handle */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].handle = 0;
+		return;
+	}
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -153,28 +208,111 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		/* Only the last user gives the memory back */
+		if (!zram_dedup_put(zram, (struct zram_dedup_entry *)handle)) {
+			zram_stat_dec(&zram->stats.pages_dedup);
+			zram_stat64_sub(zram, &zram->stats.dedup_saved, clen);
+			goto out;
+		}
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
+
+	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+
+out:
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+	} else if (clen <= PAGE_SIZE / 2) {
+		zram_stat_dec(&zram->stats.good_compress);
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	zram_stat_dec(&zram->stats.pages_stored);
 
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
+}
 
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+static void zram_free_page(struct zram *zram, size_t index)
+{
+	spin_lock(&zram->table_lock);
+	__zram_free_page(zram, index);
+	spin_unlock(&zram->table_lock);
+}
+
+static void zram_bio_end_io_sync(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronously transfer one page to or from the backing device */
+static int zram_bdev_rw_sync(struct zram *zram, unsigned long blk,
+			struct page *page, int rw)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bio_end_io_sync;
+	bio->bi_private = &done;
+	if (bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bdev_work {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long blk;
+	struct page *page;
+	int ret;
+};
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_work *w;
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	w = container_of(work, struct zram_bdev_work, work);
+	w->ret = zram_bdev_rw_sync(w->zram, w->blk, w->page, READ_SYNC);
+}
+
+/*
+ * Bios submitted from within our make_request function are only
+ * dispatched once it returns, so waiting for one here would hang.
+ * Issue the read from a worker instead.
+ */
+static int zram_bdev_read(struct zram *zram, unsigned long blk,
+			struct page *page)
+{
+	struct zram_bdev_work w;
+
+	w.zram = zram;
+	w.blk = blk;
+	w.page = page;
+	INIT_WORK_ONSTACK(&w.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &w.work);
+	flush_work(&w.work);
+	destroy_work_on_stack(&w.work);
+
+	return w.ret;
 }
 
 static void handle_zero_page(struct page *page)
@@ -188,18 +326,31 @@ static void handle_zero_page(struct page *page)
 	flush_dcache_page(page);
 }
 
+static void handle_same_page(struct page *page, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+		user_mem[pos] = element;
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
+	unsigned long handle = zram_get_handle(zram, index);
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
+	zs_unmap_object(zram->mem_pool, handle);
 	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
 
 	flush_dcache_page(page);
 }
@@ -214,23 +365,53 @@ static void zram_read(struct zram *zram, struct bio *bio)
 	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	if (zram->bdev)
+		down_read(&zram->wb_lock);
+
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
+		unsigned long handle;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		if (unlikely(zram_test_flag(zram, index, ZRAM_IDLE))) {
+			spin_lock(&zram->table_lock);
+			zram_clear_flag(zram, index, ZRAM_IDLE);
+			spin_unlock(&zram->table_lock);
+		}
+
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			ret = zram_bdev_read(zram, zram->table[index].handle,
+					page);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+						&zram->stats.failed_reads);
+				goto out;
+			}
+			zram_stat64_inc(zram, &zram->stats.bd_reads);
+			index++;
+			continue;
+		}
+
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			handle_zero_page(page);
 			index++;
 			continue;
 		}
 
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			handle_same_page(page, zram->table[index].handle);
+			index++;
+			continue;
+		}
+
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		handle = zram_get_handle(zram, index);
+		if (unlikely(!handle)) {
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			handle_zero_page(page);
@@ -246,21 +427,16 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		}
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		ret = zram_comp_decompress(zram->comp, cmem,
+			zram->table[index].size, user_mem);
 
+		zs_unmap_object(zram->mem_pool, handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -271,11 +447,16 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		index++;
 	}
 
+	if (zram->bdev)
+		up_read(&zram->wb_lock);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
 
 out:
+	if (zram->bdev)
+		up_read(&zram->wb_lock);
 	bio_io_error(bio);
 }
 
@@ -290,42 +471,56 @@ static void zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
 		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		u32 checksum = 0;
+		unsigned long handle, element;
+		struct zram_dedup_entry *entry;
+		struct zram_comp_strm *strm;
+		struct page *page;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
+		if (zram->table[index].handle || zram->table[index].flags)
 			zram_free_page(zram, index);
 
-		mutex_lock(&zram->lock);
+		/*
+		 * Compression runs outside zram->lock on a private stream
+		 * so that concurrent writers only serialise on the short
+		 * allocate-and-copy step below.
+		 */
+		strm = zram_strm_find(&zram->strm_pool);
+		src = strm->buffer;
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_strm_release(&zram->strm_pool, strm);
+			spin_lock(&zram->table_lock);
+			if (!element) {
+				zram_stat_inc(&zram->stats.pages_zero);
+				zram_set_flag(zram, index, ZRAM_ZERO);
+			} else {
+				zram->table[index].handle = element;
+				zram_stat_inc(&zram->stats.pages_same);
+				zram_set_flag(zram, index, ZRAM_SAME);
+			}
+			spin_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		ret = zram_comp_compress(zram->comp, user_mem, src, &clen,
+					strm->workmem);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_strm_release(&zram->strm_pool, strm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -336,59 +531,74 @@ static void zram_write(struct zram *zram, struct bio *bio)
 		 * since we do not want to return too many disk write
 		 * errors which has side effect of hanging the system.
 		 */
-		if (unlikely(clen > max_zpage_size)) {
+		if (unlikely(clen > max_zpage_size))
 			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+		/* Share an identical object that is already stored */
+		if (zram->dedup_enable && clen != PAGE_SIZE) {
+			checksum = zram_dedup_checksum(src, clen);
+			entry = zram_dedup_get(zram, src, clen, checksum);
+			if (entry) {
+				zram_strm_release(&zram->strm_pool, strm);
+				handle = (unsigned long)entry;
+				zram_lock_table(zram);
+				spin_lock(&zram->table_lock);
+				zram->table[index].handle = handle;
+				zram->table[index].size = clen;
+				zram_set_flag(zram, index, ZRAM_DEDUP);
+				spin_unlock(&zram->table_lock);
+				zram_stat_inc(&zram->stats.pages_dedup);
+				zram_stat64_add(zram, &zram->stats.dedup_saved,
+						clen);
+				goto stats;
+			}
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
+		zram_lock_table(zram);
+
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (unlikely(!handle)) {
 			mutex_unlock(&zram->lock);
+			zram_strm_release(&zram->strm_pool, strm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		if (unlikely(clen == PAGE_SIZE)) {
+			zram_stat_inc(&zram->stats.pages_expand);
+			src = kmap_atomic(page, KM_USER0);
 		}
-#endif
 
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+		if (unlikely(clen == PAGE_SIZE))
 			kunmap_atomic(src, KM_USER0);
 
-		/* Update stats */
+		entry = NULL;
+		if (zram->dedup_enable && clen != PAGE_SIZE)
+			entry = zram_dedup_new(zram, handle, clen, checksum);
+
+		spin_lock(&zram->table_lock);
+		if (unlikely(clen == PAGE_SIZE))
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		if (entry) {
+			zram->table[index].handle = (unsigned long)entry;
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+		} else {
+			zram->table[index].handle = handle;
+		}
+		zram->table[index].size = clen;
+		spin_unlock(&zram->table_lock);
+
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		zram_strm_release(&zram->strm_pool, strm);
+
+stats:
+		/* Update stats */
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
@@ -453,6 +663,351 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+	vfree(zram->wb_bitmap);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->wb_bitmap = NULL;
+	zram->nr_wb_blocks = 0;
+}
+
+/*
+ * Open the block device at @path to receive written back pages.
+ * Caller holds init_lock and the device is not initialized yet.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	struct file *file;
+	struct inode *inode;
+	struct block_device *bdev;
+	unsigned long nr_blocks, *bitmap;
+
+	file = filp_open(path, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	inode = file->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out;
+	}
+
+	/* blkdev_get() drops the reference again if it fails */
+	bdev = bdgrab(I_BDEV(inode));
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0)
+		goto out;
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = NULL;
+	if (nr_blocks)
+		bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		ret = nr_blocks ? -ENOMEM : -EINVAL;
+		goto out;
+	}
+
+	zram_reset_backing_dev(zram);
+	zram->backing_dev = file;
+	zram->bdev = bdev;
+	zram->wb_bitmap = bitmap;
+	zram->nr_wb_blocks = nr_blocks;
+
+	pr_info("Using %s as backing device (%lu pages)\n", path, nr_blocks);
+	return 0;
+
+out:
+	filp_close(file, NULL);
+	return ret;
+}
+
+/*
+ * Mark every page currently held in memory idle. Reads and writes clear
+ * the mark again, so a later writeback of idle pages only picks pages
+ * that were not touched in between.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		spin_lock(&zram->table_lock);
+		if ((zram->table[index].handle || zram->table[index].flags) &&
+				!zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		spin_unlock(&zram->table_lock);
+	}
+}
+
+struct zram_wb_batch;
+
+struct zram_wb_req {
+	struct zram_wb_batch *batch;
+	struct page *page;	/* uncompressed copy of the slot */
+	unsigned long blk;
+	u32 index;
+	int error;
+};
+
+struct zram_wb_batch {
+	struct zram_wb_req req[ZRAM_WB_BATCH];
+	int nr;
+	atomic_t pending;
+	struct completion done;
+	unsigned char *buf;	/* compressed copy of the object */
+};
+
+/*
+ * Queue slot @index in the batch if it qualifies for writeback under
+ * @mode, reserving a block for it on the backing device. Returns 1 if
+ * the slot was queued, 0 if it was skipped and -ENOSPC once the backing
+ * device is full.
+ */
+static int zram_wb_prepare(struct zram *zram, struct zram_wb_batch *wb,
+			u32 index, enum zram_wb_mode mode)
+{
+	int ret;
+	u16 clen;
+	unsigned long blk, handle;
+	unsigned char *user_mem, *cmem;
+	struct zram_wb_req *req = &wb->req[wb->nr];
+
+	spin_lock(&zram->table_lock);
+
+	/*
+	 * Only slots that own an object give memory back. Same filled
+	 * and shared pages cost next to nothing in memory already.
+	 */
+	handle = zram->table[index].handle;
+	if (!handle || (zram->table[index].flags & (BIT(ZRAM_SAME) |
+			BIT(ZRAM_DEDUP) | BIT(ZRAM_WB) | BIT(ZRAM_UNDER_WB))))
+		goto skip;
+
+	if (mode == ZRAM_WB_IDLE && !zram_test_flag(zram, index, ZRAM_IDLE))
+		goto skip;
+
+	if (mode == ZRAM_WB_HUGE &&
+			!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		goto skip;
+
+	blk = find_first_zero_bit(zram->wb_bitmap, zram->nr_wb_blocks);
+	if (blk >= zram->nr_wb_blocks) {
+		spin_unlock(&zram->table_lock);
+		return -ENOSPC;
+	}
+	__set_bit(blk, zram->wb_bitmap);
+	zram_set_flag(zram, index, ZRAM_UNDER_WB);
+
+	/*
+	 * Copy the object while table_lock keeps it from being freed and
+	 * decompress it only after dropping the lock.
+	 */
+	clen = zram->table[index].size;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	if (clen == PAGE_SIZE) {
+		user_mem = kmap_atomic(req->page, KM_USER0);
+		memcpy(user_mem, cmem, PAGE_SIZE);
+		kunmap_atomic(user_mem, KM_USER0);
+	} else {
+		memcpy(wb->buf, cmem, clen);
+	}
+	zs_unmap_object(zram->mem_pool, handle);
+
+	spin_unlock(&zram->table_lock);
+
+	if (clen != PAGE_SIZE) {
+		user_mem = kmap_atomic(req->page, KM_USER0);
+		ret = zram_comp_decompress(zram->comp, wb->buf, clen,
+					user_mem);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		if (unlikely(ret)) {
+			pr_err("Decompression failed! err=%d, page=%u\n",
+				ret, index);
+			spin_lock(&zram->table_lock);
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			__clear_bit(blk, zram->wb_bitmap);
+			spin_unlock(&zram->table_lock);
+			return 0;
+		}
+	}
+
+	req->index = index;
+	req->blk = blk;
+	req->error = 0;
+	wb->nr++;
+
+	return 1;
+
+skip:
+	spin_unlock(&zram->table_lock);
+	return 0;
+}
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_req *req = bio->bi_private;
+	struct zram_wb_batch *wb = req->batch;
+
+	if (err || !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		req->error = -EIO;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&wb->pending))
+		complete(&wb->done);
+}
+
+/* Write out all queued pages under one plug and wait for them */
+static void zram_wb_submit(struct zram *zram, struct zram_wb_batch *wb)
+{
+	int i;
+	struct bio *bio;
+	struct blk_plug plug;
+	struct zram_wb_req *req;
+
+	/* Hold a count ourselves so completions cannot race the loop */
+	atomic_set(&wb->pending, 1);
+	INIT_COMPLETION(wb->done);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < wb->nr; i++) {
+		req = &wb->req[i];
+
+		/* May sleep but does not fail */
+		bio = bio_alloc(GFP_NOIO, 1);
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = req->blk << SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_wb_end_io;
+		bio->bi_private = req;
+		bio_add_page(bio, req->page, PAGE_SIZE, 0);
+
+		atomic_inc(&wb->pending);
+		submit_bio(WRITE, bio);
+	}
+	blk_finish_plug(&plug);
+
+	if (!atomic_dec_and_test(&wb->pending))
+		wait_for_completion(&wb->done);
+}
+
+/*
+ * Point the written slots at their blocks and free their objects,
+ * unless a slot was freed or rewritten while its write was in flight.
+ */
+static int zram_wb_commit(struct zram *zram, struct zram_wb_batch *wb)
+{
+	int i, ret = 0;
+	u32 index;
+	struct zram_wb_req *req;
+
+	down_write(&zram->wb_lock);
+	spin_lock(&zram->table_lock);
+
+	for (i = 0; i < wb->nr; i++) {
+		req = &wb->req[i];
+		index = req->index;
+
+		if (req->error)
+			ret = req->error;
+
+		if (req->error ||
+				!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			__clear_bit(req->blk, zram->wb_bitmap);
+			continue;
+		}
+
+		__zram_free_page(zram, index);
+		zram->table[index].handle = req->blk;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_wb);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+	}
+
+	spin_unlock(&zram->table_lock);
+	up_write(&zram->wb_lock);
+
+	return ret;
+}
+
+/*
+ * Move the pages selected by @mode to the backing device, ZRAM_WB_BATCH
+ * at a time. Caller holds init_lock on an initialized device.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int i, err, ret = 0;
+	u32 index, nr_pages;
+	struct zram_wb_batch *wb;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return -ENOMEM;
+
+	init_completion(&wb->done);
+	wb->buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!wb->buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		wb->req[i].batch = wb;
+		wb->req[i].page = alloc_page(GFP_KERNEL);
+		if (!wb->req[i].page) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	index = 0;
+	while (index < nr_pages) {
+		wb->nr = 0;
+		for (; index < nr_pages && wb->nr < ZRAM_WB_BATCH; index++) {
+			ret = zram_wb_prepare(zram, wb, index, mode);
+			if (ret < 0)
+				break;
+		}
+
+		if (wb->nr) {
+			zram_wb_submit(zram, wb);
+			err = zram_wb_commit(zram, wb);
+			if (err) {
+				pr_err("Backing device write failed!\n");
+				ret = err;
+				break;
+			}
+		}
+
+		if (ret < 0)
+			break;
+		cond_resched();
+	}
+
+out:
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		if (wb->req[i].page)
+			__free_page(wb->req[i].page);
+	}
+	kfree(wb->buf);
+	kfree(wb);
+
+	return ret < 0 ? ret : 0;
+}
+
 void zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -461,33 +1016,25 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	if (zram->strm_pool.max_strm)
+		zram_strm_pool_destroy(&zram->strm_pool);
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
+		if (!zram->table[index].handle)
 			continue;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+		/* Also drops shared (deduplicated) objects exactly once */
+		zram_free_page(zram, index);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_reset_backing_dev(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,17 +1058,11 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_strm_pool_create(&zram->strm_pool, zram->comp,
+				zram->max_comp_streams);
+	if (ret) {
+		pr_err("Error allocating %d compression streams\n",
+			zram->max_comp_streams);
 		goto fail;
 	}
 
@@ -540,7 +1081,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -582,6 +1123,12 @@ static int create_device(struct zram *zram, int device_id)
 	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->table_lock);
+	init_rwsem(&zram->wb_lock);
+
+	zram->comp = zram_comp_default;
+	zram->max_comp_streams = num_online_cpus();
+	spin_lock_init(&zram->dedup_lock);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -713,6 +1260,8 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		else
+			zram_reset_backing_dev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
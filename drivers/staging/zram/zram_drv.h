@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zram_comp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,20 +29,14 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
+/* Upper bound for the max_comp_streams sysfs node */
+static const unsigned max_comp_streams_limit = 32;
+
+/* Pages written to the backing device per batch of bios */
+#define ZRAM_WB_BATCH		32
+
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
@@ -50,9 +47,8 @@ static const unsigned default_disksize_perc_ram = 25;
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
- * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ * NOTE: max_zpage_size must be less than ZS_MAX_ALLOC_SIZE (PAGE_SIZE),
+ * incompressible pages are stored in the PAGE_SIZE class as-is.
  */
 
 /*-- End of configurable params */
@@ -71,6 +67,21 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is one word repeated, stored in table[page_no].handle */
+	ZRAM_SAME,
+
+	/* table[page_no].handle points to a shared zram_dedup_entry */
+	ZRAM_DEDUP,
+
+	/* Page lives on the backing device, handle is its block index */
+	ZRAM_WB,
+
+	/* Page was not accessed since userspace last marked pages idle */
+	ZRAM_IDLE,
+
+	/* Page is being copied to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -78,8 +89,8 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	unsigned long handle;
+	u16 size;	/* compressed size in bytes */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -92,20 +103,42 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 lock_waits;		/* writers that found zram->lock taken */
+	u64 lock_wait_ns;	/* total time spent waiting for it */
+	u64 dedup_saved;	/* compressed bytes shared, not stored */
+	u64 bd_writes;		/* pages written to the backing device */
+	u64 bd_reads;		/* pages read back from it */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of non-zero same filled pages */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
+	u32 pages_wb;		/* no. of pages on the backing device */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_comp *comp;	/* compression backend */
+	struct zram_strm_pool strm_pool;
+	int max_comp_streams;
 	struct table *table;
+	int dedup_enable;
+	spinlock_t dedup_lock;	/* protect dedup_root and refcounts */
+	struct rb_root dedup_root;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	struct mutex lock;	/* serialise object allocation and table
+				 * updates between concurrent writes */
+	spinlock_t table_lock;	/* protect table entries and wb_bitmap
+				 * against free notifications and
+				 * writeback */
+	/* Optional block device that pages can be written back to */
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned long nr_wb_blocks;
+	unsigned long *wb_bitmap;	/* blocks in use on bdev */
+	struct rw_semaphore wb_lock;	/* keep readers off slots that
+					 * are moved to bdev */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -128,5 +161,15 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+
+/* Slots selected by zram_writeback() */
+enum zram_wb_mode {
+	ZRAM_WB_IDLE,		/* pages marked idle and not since used */
+	ZRAM_WB_HUGE,		/* incompressible pages */
+};
+
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
 
 #endif
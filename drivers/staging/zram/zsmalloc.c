@@ -0,0 +1,656 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are sorted into size classes ZS_SIZE_CLASS_DELTA bytes apart.
+ * Each class carves its objects out of zspages: small groups of 0-order
+ * pages in which objects are laid out back to back, ignoring page
+ * boundaries. Unlike xvmalloc, a class never leaves the tail of a page
+ * unused just because the next object would not fit, and a page is only
+ * ever shared by objects of one size, which keeps holes from forming.
+ *
+ * Callers get an opaque handle instead of a <page, offset> pair. That
+ * lets zs_compact() move objects out of sparsely used zspages and give
+ * whole pages back to the system.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Handles are tiny and plentiful; all pools share one cache for them */
+static struct kmem_cache *zs_handle_cachep;
+static int zs_handle_cache_users;
+static DEFINE_MUTEX(zs_handle_cache_lock);
+
+static int zs_handle_cache_get(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_handle_cache_lock);
+	if (!zs_handle_cache_users) {
+		zs_handle_cachep = kmem_cache_create("zs_handle",
+				sizeof(struct zs_handle), 0, 0, NULL);
+		if (!zs_handle_cachep)
+			ret = -ENOMEM;
+	}
+	if (!ret)
+		zs_handle_cache_users++;
+	mutex_unlock(&zs_handle_cache_lock);
+
+	return ret;
+}
+
+static void zs_handle_cache_put(void)
+{
+	mutex_lock(&zs_handle_cache_lock);
+	if (!--zs_handle_cache_users) {
+		kmem_cache_destroy(zs_handle_cachep);
+		zs_handle_cachep = NULL;
+	}
+	mutex_unlock(&zs_handle_cache_lock);
+}
+
+static struct size_class *get_size_class(struct zs_pool *pool, size_t size)
+{
+	unsigned int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return &pool->classes[idx];
+}
+
+/*
+ * Pick the zspage size (in pages) that wastes the smallest fraction of
+ * memory for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_usedpc = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usedpc;
+
+		usedpc = (zspage_size / size) * size * 100 / zspage_size;
+		if (usedpc > best_usedpc) {
+			best_usedpc = usedpc;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static struct zs_handle *to_handle(unsigned long handle)
+{
+	return (struct zs_handle *)handle;
+}
+
+static void pin_handle(struct zs_handle *h)
+{
+	bit_spin_lock(ZS_HANDLE_PINNED, &h->flags);
+}
+
+static int trypin_handle(struct zs_handle *h)
+{
+	return bit_spin_trylock(ZS_HANDLE_PINNED, &h->flags);
+}
+
+static void unpin_handle(struct zs_handle *h)
+{
+	bit_spin_unlock(ZS_HANDLE_PINNED, &h->flags);
+}
+
+/* Page holding the first byte of the object and its offset within it */
+static struct page *obj_location(struct zspage *zspage, unsigned int idx,
+				unsigned int *offset)
+{
+	unsigned long off = (unsigned long)idx * zspage->class->size;
+
+	*offset = off & ~PAGE_MASK;
+	return zspage->pages[off >> PAGE_SHIFT];
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+	unsigned int nr_pages = zspage->class->pages_per_zspage;
+
+	for (i = 0; i < nr_pages; i++) {
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	}
+	kfree(zspage);
+
+	atomic_long_sub(nr_pages, &pool->pages_used);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			class->objs_per_zspage * sizeof(zspage->slots[0]),
+			pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	atomic_long_add(class->pages_per_zspage, &pool->pages_used);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i]) {
+			free_zspage(pool, zspage);
+			return NULL;
+		}
+	}
+
+	/* Chain all slots into the free list */
+	for (i = 0; i < class->objs_per_zspage - 1; i++)
+		zspage->slots[i] = ((unsigned long)(i + 1) << 1) |
+					ZS_SLOT_FREE;
+	zspage->slots[i] = ((unsigned long)ZS_NO_FREE << 1) | ZS_SLOT_FREE;
+	zspage->free_idx = 0;
+
+	return zspage;
+}
+
+/* Take a free slot from a zspage. Called with class->lock held. */
+static unsigned int obj_take_slot(struct zspage *zspage, struct zs_handle *h)
+{
+	struct size_class *class = zspage->class;
+	unsigned int idx = zspage->free_idx;
+
+	BUG_ON(idx == ZS_NO_FREE);
+
+	zspage->free_idx = zspage->slots[idx] >> 1;
+	zspage->slots[idx] = (unsigned long)h;
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	h->zspage = zspage;
+	h->idx = idx;
+
+	return idx;
+}
+
+/*
+ * Return a slot to its zspage. Called with class->lock held; returns
+ * true if the zspage became empty (it is then off all lists and must
+ * be freed by the caller).
+ */
+static bool obj_put_slot(struct zspage *zspage, unsigned int idx)
+{
+	struct size_class *class = zspage->class;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move_tail(&zspage->list, &class->partial);
+
+	zspage->slots[idx] = ((unsigned long)zspage->free_idx << 1) |
+				ZS_SLOT_FREE;
+	zspage->free_idx = idx;
+	zspage->inuse--;
+	class->objs_inuse--;
+
+	if (zspage->inuse)
+		return false;
+
+	list_del(&zspage->list);
+	class->num_zspages--;
+	return true;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @flags: allocation flags used to allocate pool pages
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(gfp_t flags)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+	}
+
+	pool->flags = flags;
+	mutex_init(&pool->compact_lock);
+
+	if (zs_handle_cache_get())
+		goto fail;
+	pool->handle_cachep = zs_handle_cachep;
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		if (class->num_zspages)
+			pr_info("Freeing non-empty class: %u (%lu objects)\n",
+				class->size, class->objs_inuse);
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+
+	if (pool->handle_cachep)
+		zs_handle_cache_put();
+
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * Returns a handle to the new object, or 0 on failure. The object
+ * has to be mapped with zs_map_object() before it can be accessed.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_handle *h;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	h = kmem_cache_alloc(pool->handle_cachep,
+			pool->flags & ~__GFP_HIGHMEM);
+	if (!h)
+		return 0;
+	h->flags = 0;
+
+	class = get_size_class(pool, size);
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class);
+		if (!zspage) {
+			kmem_cache_free(pool->handle_cachep, h);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->num_zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	obj_take_slot(zspage, h);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)h;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	bool empty;
+	struct zspage *zspage;
+	struct size_class *class;
+	struct zs_handle *h = to_handle(handle);
+
+	if (unlikely(!handle))
+		return;
+
+	/* Keep zs_compact() from moving the object while we free it */
+	pin_handle(h);
+	class = h->zspage->class;
+	spin_lock(&class->lock);
+	zspage = h->zspage;
+	empty = obj_put_slot(zspage, h->idx);
+	spin_unlock(&class->lock);
+	unpin_handle(h);
+
+	if (empty)
+		free_zspage(pool, zspage);
+
+	kmem_cache_free(pool->handle_cachep, h);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: mapping mode to use
+ *
+ * The object is pinned against migration until zs_unmap_object(). Like
+ * kmap_atomic(), this disables preemption, so the caller must not sleep
+ * and may keep only one object mapped at a time. It uses KM_USER1, so
+ * the caller is free to use KM_USER0 meanwhile.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct page *page;
+	unsigned int off, size, first;
+	struct zs_map_area *area;
+	struct zs_handle *h = to_handle(handle);
+	char *addr;
+
+	pin_handle(h);
+
+	area = get_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	size = h->zspage->class->size;
+	page = obj_location(h->zspage, h->idx, &off);
+
+	/* Common case: the object is within one page */
+	if (off + size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(page, KM_USER1);
+		return area->vaddr + off;
+	}
+
+	area->vaddr = NULL;
+	if (mm == ZS_MM_WO)
+		return area->buf;
+
+	first = PAGE_SIZE - off;
+	addr = kmap_atomic(page, KM_USER1);
+	memcpy(area->buf, addr + off, first);
+	kunmap_atomic(addr, KM_USER1);
+
+	page = h->zspage->pages[((unsigned long)h->idx * size >>
+				PAGE_SHIFT) + 1];
+	addr = kmap_atomic(page, KM_USER1);
+	memcpy(area->buf + first, addr, size - first);
+	kunmap_atomic(addr, KM_USER1);
+
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct page *page;
+	unsigned int off, size, first;
+	struct zs_map_area *area;
+	struct zs_handle *h = to_handle(handle);
+	char *addr;
+
+	area = this_cpu_ptr(pool->map_area);
+
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+		goto out;
+	}
+
+	if (area->mm == ZS_MM_RO)
+		goto out;
+
+	/* Copy the bounce buffer back to both halves of the object */
+	size = h->zspage->class->size;
+	page = obj_location(h->zspage, h->idx, &off);
+	first = PAGE_SIZE - off;
+
+	addr = kmap_atomic(page, KM_USER1);
+	memcpy(addr + off, area->buf, first);
+	kunmap_atomic(addr, KM_USER1);
+
+	page = h->zspage->pages[((unsigned long)h->idx * size >>
+				PAGE_SHIFT) + 1];
+	addr = kmap_atomic(page, KM_USER1);
+	memcpy(addr, area->buf + first, size - first);
+	kunmap_atomic(addr, KM_USER1);
+
+out:
+	put_cpu_ptr(pool->map_area);
+	unpin_handle(h);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Copy one object between zspages of the same class. Either side may
+ * straddle a page boundary, so copy in pieces that lie within a single
+ * page on both sides.
+ */
+static void zs_copy_object(struct zspage *dst, unsigned int dst_idx,
+			struct zspage *src, unsigned int src_idx)
+{
+	unsigned int size = src->class->size;
+	unsigned long s_off = (unsigned long)src_idx * size;
+	unsigned long d_off = (unsigned long)dst_idx * size;
+	unsigned int done = 0;
+
+	while (done < size) {
+		unsigned int s_in = (s_off + done) & ~PAGE_MASK;
+		unsigned int d_in = (d_off + done) & ~PAGE_MASK;
+		unsigned int len = size - done;
+		char *s_addr, *d_addr;
+
+		len = min_t(unsigned int, len, PAGE_SIZE - s_in);
+		len = min_t(unsigned int, len, PAGE_SIZE - d_in);
+
+		s_addr = kmap_atomic(src->pages[(s_off + done) >> PAGE_SHIFT],
+					KM_USER0);
+		d_addr = kmap_atomic(dst->pages[(d_off + done) >> PAGE_SHIFT],
+					KM_USER1);
+		memcpy(d_addr + d_in, s_addr + s_in, len);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		done += len;
+	}
+}
+
+/* Least used partial zspage: the cheapest one to empty */
+static struct zspage *find_compact_src(struct size_class *class)
+{
+	struct zspage *zspage, *src = NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+
+	return src;
+}
+
+/* Any other partial zspage still has room: fill it up */
+static struct zspage *find_compact_dst(struct size_class *class,
+				struct zspage *src)
+{
+	struct zspage *zspage;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage != src)
+			return zspage;
+	}
+
+	return NULL;
+}
+
+/*
+ * Move objects out of the least used zspages of a class into the free
+ * slots of the others, for as long as that empties whole zspages.
+ * Stops early if it runs into an object that is currently mapped.
+ * Returns the number of pages released.
+ */
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+
+	spin_lock(&class->lock);
+	for (;;) {
+		unsigned long free_slots;
+		unsigned int idx;
+
+		src = find_compact_src(class);
+		if (!src)
+			break;
+
+		/* Only worth it if the others can absorb all of src */
+		free_slots = class->num_zspages * class->objs_per_zspage -
+				class->objs_inuse;
+		if (free_slots - (class->objs_per_zspage - src->inuse) <
+				src->inuse)
+			break;
+
+		for (idx = 0; src->inuse && idx < class->objs_per_zspage;
+				idx++) {
+			struct zs_handle *h;
+
+			if (src->slots[idx] & ZS_SLOT_FREE)
+				continue;
+
+			h = (struct zs_handle *)src->slots[idx];
+			if (!trypin_handle(h))
+				goto out;
+
+			dst = find_compact_dst(class, src);
+			BUG_ON(!dst);
+
+			/* src stays on the partial list, so no list moves */
+			obj_take_slot(dst, h);
+			zs_copy_object(dst, h->idx, src, idx);
+			obj_put_slot(src, idx);
+
+			unpin_handle(h);
+			atomic_long_inc(&pool->objs_migrated);
+		}
+
+		/* obj_put_slot() already took the empty src off the list */
+		spin_unlock(&class->lock);
+		free_zspage(pool, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+out:
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Release pages held by sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Migrates objects so that partially used zspages are merged, then
+ * frees the zspages that end up empty. Objects that are mapped while
+ * this runs are left in place. May sleep.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	mutex_lock(&pool->compact_lock);
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		freed += zs_compact_class(pool, &pool->classes[i]);
+		cond_resched();
+	}
+	mutex_unlock(&pool->compact_lock);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_used) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	stats->obj_bytes = 0;
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		stats->obj_bytes += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	stats->pages_used = atomic_long_read(&pool->pages_used);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+	stats->objs_migrated = atomic_long_read(&pool->objs_migrated);
+}
+EXPORT_SYMBOL_GPL(zs_get_stats);
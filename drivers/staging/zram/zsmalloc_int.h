@@ -0,0 +1,113 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many (not necessarily contiguous)
+ * 0-order pages. Objects are packed back to back across the whole
+ * group, so an object may straddle two pages.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/* Size classes are this far apart. Must be a power of two. */
+#define ZS_SIZE_CLASS_DELTA	16
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* End of user params */
+
+#define ZS_SIZE_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+				ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * Object slots: a used slot holds its struct zs_handle pointer, a free
+ * slot holds the index of the next free slot, shifted left and tagged
+ * with ZS_SLOT_FREE (handles are at least word aligned).
+ */
+#define ZS_SLOT_FREE		1UL
+#define ZS_NO_FREE		0xffff
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* class partial or full list */
+	struct size_class *class;
+	u16 inuse;			/* objects allocated */
+	u16 free_idx;			/* first free slot or ZS_NO_FREE */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long slots[0];
+};
+
+/*
+ * What zs_malloc() hands out. Compaction moves objects, so the caller
+ * holds on to this indirection rather than a <page, offset> pair.
+ */
+struct zs_handle {
+	unsigned long flags;
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+enum zs_handle_flags {
+	/* Object is mapped and must not be migrated */
+	ZS_HANDLE_PINNED,
+};
+
+struct size_class {
+	spinlock_t lock;
+	unsigned int size;
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	/* zspages with at least one free slot, preferred ones first */
+	struct list_head partial;
+	struct list_head full;
+
+	unsigned long num_zspages;
+	unsigned long objs_inuse;
+};
+
+/* Per-cpu bounce buffer for objects that straddle two pages */
+struct zs_map_area {
+	char *buf;
+	void *vaddr;		/* set when the object is kmapped in place */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class classes[ZS_SIZE_CLASSES];
+	gfp_t flags;
+
+	struct kmem_cache *handle_cachep;	/* shared by all pools */
+	struct zs_map_area __percpu *map_area;
+
+	/* Serialises zs_compact() runs */
+	struct mutex compact_lock;
+
+	atomic_long_t pages_used;
+	atomic_long_t pages_compacted;
+	atomic_long_t objs_migrated;
+};
+
+#endif
@@ -39,6 +39,9 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Cost-benefit gc: ages (in blocks allocated since) beyond this all look the same */
+#define YAFFS_GC_MAX_AGE 0xffff
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
@@ -50,8 +53,8 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 
 /* Function to calculate chunk and offset */
 
-static void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
-				int *chunk_out, u32 * offset_out)
+void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
+			 int *chunk_out, u32 * offset_out)
 {
 	int chunk;
 	u32 offset;
@@ -255,6 +258,8 @@ static void yaffs_handle_chunk_update(struct yaffs_dev *dev, int nand_chunk,
 void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 			      struct yaffs_block_info *bi)
 {
+	/* Readers holding the device shared can get here concurrently */
+	spin_lock(&dev->read_state_lock);
 	if (!bi->gc_prioritise) {
 		bi->gc_prioritise = 1;
 		dev->has_pending_prioritised_gc = 1;
@@ -266,6 +271,7 @@ void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 
 		}
 	}
+	spin_unlock(&dev->read_state_lock);
 }
 
 static void yaffs_handle_chunk_wr_error(struct yaffs_dev *dev, int nand_chunk,
@@ -1394,10 +1400,130 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Entries in use are hashed on (obj_id, chunk_id) so lookups don't
+ *   depend on the cache size. All entries sit on an LRU list, most recently
+ *   used first, with the free ones kept at the tail so grabbing an entry
+ *   is cheap too. That lets the cache be made much bigger than the ~10
+ *   entries it was designed for.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    int obj_id, int chunk_id)
+{
+	u32 key = ((u32) obj_id << 20) ^ (u32) chunk_id;
+
+	return &dev->cache_hash[hash_32(key, dev->cache_hash_bits)];
+}
+
+static struct yaffs_cache *yaffs_cache_lookup(struct yaffs_dev *dev,
+					      const struct yaffs_obj *obj,
+					      int chunk_id)
+{
+	struct yaffs_cache *cache;
+	struct list_head *bucket =
+	    yaffs_cache_bucket(dev, obj->obj_id, chunk_id);
+
+	list_for_each_entry(cache, bucket, hash_link) {
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
+	}
+	return NULL;
+}
+
+/* Attach a free cache entry to a chunk. */
+static void yaffs_cache_assign(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link,
+		 yaffs_cache_bucket(dev, obj->obj_id, chunk_id));
+}
+
+/* Free up a cache entry, dropping whatever was in it. */
+static void yaffs_cache_release(struct yaffs_dev *dev,
+				struct yaffs_cache *cache)
+{
+	list_del_init(&cache->hash_link);
+	cache->object = NULL;
+	cache->dirty = 0;
+	list_move_tail(&cache->lru, &dev->cache_lru);
+}
+
+static int yaffs_init_cache(struct yaffs_dev *dev)
+{
+	int n_caches;
+	int n_buckets;
+	int i;
+
+	if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
+		dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
+	n_caches = dev->param.n_caches;
+
+	dev->cache_hash_bits = ilog2(roundup_pow_of_two(n_caches));
+	n_buckets = 1 << dev->cache_hash_bits;
+
+	dev->cache = kmalloc(n_caches * sizeof(struct yaffs_cache), GFP_NOFS);
+	dev->cache_alt = 0;
+	if (!dev->cache) {
+		dev->cache = vmalloc(n_caches * sizeof(struct yaffs_cache));
+		dev->cache_alt = 1;
+	}
+	if (dev->cache)
+		memset(dev->cache, 0, n_caches * sizeof(struct yaffs_cache));
+
+	dev->cache_hash = kmalloc(n_buckets * sizeof(struct list_head),
+				  GFP_NOFS);
+	dev->cache_flush = kmalloc(n_caches * sizeof(struct yaffs_cache *),
+				   GFP_NOFS);
+	if (!dev->cache || !dev->cache_hash || !dev->cache_flush)
+		return YAFFS_FAIL;
+
+	for (i = 0; i < n_buckets; i++)
+		INIT_LIST_HEAD(&dev->cache_hash[i]);
+	INIT_LIST_HEAD(&dev->cache_lru);
+
+	for (i = 0; i < n_caches; i++) {
+		struct yaffs_cache *cache = &dev->cache[i];
+
+		INIT_LIST_HEAD(&cache->hash_link);
+		list_add_tail(&cache->lru, &dev->cache_lru);
+		cache->data =
+		    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
+		if (!cache->data)
+			return YAFFS_FAIL;
+	}
+
+	return YAFFS_OK;
+}
+
+static void yaffs_deinit_cache(struct yaffs_dev *dev)
+{
+	int i;
+
+	if (dev->cache) {
+		for (i = 0; i < dev->param.n_caches; i++) {
+			kfree(dev->cache[i].data);
+			dev->cache[i].data = NULL;
+		}
+
+		if (dev->cache_alt)
+			vfree(dev->cache);
+		else
+			kfree(dev->cache);
+		dev->cache = NULL;
+	}
+
+	kfree(dev->cache_hash);
+	dev->cache_hash = NULL;
+	kfree(dev->cache_flush);
+	dev->cache_flush = NULL;
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
@@ -1414,47 +1540,53 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(const struct yaffs_cache **)a;
+	const struct yaffs_cache *cb = *(const struct yaffs_cache **)b;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
 	int i;
+	int n_dirty = 0;
 	struct yaffs_cache *cache;
 	int chunk_written = 0;
 	int n_caches = obj->my_dev->param.n_caches;
 
 	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+		/* Gather up the object's dirty chunks and write them out
+		 * lowest chunk id first.
+		 */
+		for (i = 0; i < n_caches; i++) {
+			if (dev->cache[i].object == obj &&
+			    dev->cache[i].dirty)
+				dev->cache_flush[n_dirty++] = &dev->cache[i];
+		}
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+		sort(dev->cache_flush, n_dirty, sizeof(struct yaffs_cache *),
+		     yaffs_cache_cmp, NULL);
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+		for (i = 0; i < n_dirty; i++) {
+			cache = dev->cache_flush[i];
+			if (cache->locked)
+				break;
 
-		} while (cache && chunk_written > 0);
+			/* Write it out and free it up */
+			chunk_written =
+			    yaffs_wr_data_obj(cache->object,
+					      cache->chunk_id,
+					      cache->data,
+					      cache->n_bytes, 1);
+			yaffs_cache_release(dev, cache);
+			if (chunk_written <= 0)
+				break;
+		}
 
-		if (cache)
+		if (i < n_dirty)
 			/* Hoosterman, disk full while writing cache out. */
 			yaffs_trace(YAFFS_TRACE_ERROR,
 				"yaffs tragedy: no space during cache write");
@@ -1493,18 +1625,19 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then push out the least recently used one, flushing its object first
+ * if it is dirty.
  */
 static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
 
 	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
+		/* Free entries are kept at the tail */
+		cache = list_entry(dev->cache_lru.prev, struct yaffs_cache,
+				   lru);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -1513,49 +1646,31 @@ static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
+		/* Try find a free one... */
 
 		cache = yaffs_grab_chunk_worker(dev);
+		if (cache)
+			return cache;
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
+		/* With locking we can't assume we can use the tail */
+		list_for_each_entry_reverse(cache, &dev->cache_lru, lru) {
+			if (!cache->locked)
+				break;
+		}
+		if (&cache->lru == &dev->cache_lru)
+			return NULL;
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+		dev->cache_evictions++;
 
+		if (cache->dirty) {
+			/* Flush and try again */
+			yaffs_flush_file_cache(cache->object);
+			return yaffs_grab_chunk_worker(dev);
 		}
+
+		yaffs_cache_release(dev, cache);
 		return cache;
 	} else {
 		return NULL;
@@ -1567,38 +1682,45 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache;
 
-				return &dev->cache[i];
-			}
-		}
+	if (dev->param.n_caches > 0) {
+		cache = yaffs_cache_lookup(dev, obj, chunk_id);
+		if (cache)
+			dev->cache_hits++;
+		else
+			dev->cache_misses++;
+		return cache;
 	}
 	return NULL;
 }
 
+/*
+ * Count the chunks from chunk_id on, up to max, that are not in the cache.
+ * Each counts as a miss, just as if it had been looked up on its own.
+ */
+static int yaffs_uncached_run(const struct yaffs_obj *obj, int chunk_id,
+			      int max)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int n = 0;
+
+	while (n < max && (dev->param.n_caches < 1 ||
+			   !yaffs_cache_lookup(dev, obj, chunk_id + n)))
+		n++;
+
+	if (dev->param.n_caches > 0)
+		dev->cache_misses += n;
+	return n;
+}
+
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		list_move(&cache->lru, &dev->cache_lru);
 
 		if (is_write)
 			cache->dirty = 1;
@@ -1611,12 +1733,14 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
  */
 static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
-	if (object->my_dev->param.n_caches > 0) {
+	struct yaffs_dev *dev = object->my_dev;
+
+	if (dev->param.n_caches > 0) {
 		struct yaffs_cache *cache =
-		    yaffs_find_chunk_cache(object, chunk_id);
+		    yaffs_cache_lookup(dev, object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_release(dev, cache);
 	}
 }
 
@@ -1632,7 +1756,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_cache_release(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -2715,6 +2839,32 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * Score a gc candidate, higher is better.
+ * The default is simply how many chunks would be freed up. With
+ * gc_cost_benefit set, this is the LFS cost-benefit ratio
+ * (1 - u) * age / (1 + u), where u is the fraction of the block still in
+ * use and age is how many blocks have been allocated since. Old blocks
+ * that are still mostly live hold cold data that is unlikely to die, so
+ * they are left alone in favour of ones where the copying will pay off.
+ */
+static u32 yaffs_gc_score(struct yaffs_dev *dev, struct yaffs_block_info *bi,
+			  int pages_used)
+{
+	u32 n_chunks = dev->param.chunks_per_block;
+	u32 age;
+
+	if (!dev->param.gc_cost_benefit)
+		return n_chunks - pages_used;
+
+	age = dev->seq_number - bi->seq_number;
+	if (age > YAFFS_GC_MAX_AGE)
+		age = YAFFS_GC_MAX_AGE;
+
+	return (((n_chunks - pages_used) << 10) / (n_chunks + pages_used)) *
+	    (age + 1);
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -2771,6 +2921,7 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 	if (!selected) {
 		int pages_used;
+		u32 score;
 		int n_blocks =
 		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
@@ -2812,13 +2963,22 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 			pages_used = bi->pages_in_use - bi->soft_del_pages;
 
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
+			/*
+			 * Cost-benefit may prefer a fuller block, so make
+			 * sure it doesn't pick one passive gc can't take.
+			 */
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    pages_used >= dev->param.chunks_per_block ||
+			    (dev->param.gc_cost_benefit &&
+			     pages_used > threshold))
+				continue;
+
+			score = yaffs_gc_score(dev, bi, pages_used);
+			if ((dev->gc_dirtiest < 1 || score > dev->gc_score)
 			    && yaffs_block_ok_for_gc(dev, bi)) {
 				dev->gc_dirtiest = dev->gc_block_finder;
 				dev->gc_pages_in_use = pages_used;
+				dev->gc_score = score;
 			}
 		}
 
@@ -2991,7 +3151,7 @@ int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 
 /*-------------------- Data file manipulation -----------------*/
 
-static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
 {
 	int nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk, NULL);
 
@@ -3009,6 +3169,40 @@ static int yaffs_rd_data_obj(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
 
 }
 
+/*
+ * Read n_chunks consecutive chunks of a file. Where the chunks are also
+ * consecutive on flash they go to the driver as one request.
+ */
+void yaffs_rd_data_obj_multi(struct yaffs_obj *in, int inode_chunk,
+			     int n_chunks, u8 * buffer)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int n_bytes = dev->data_bytes_per_chunk;
+	int nand_chunk;
+	int n_run;
+	int i;
+
+	for (i = 0; i < n_chunks; i += n_run) {
+		nand_chunk = yaffs_find_chunk_in_file(in, inode_chunk + i, NULL);
+		n_run = 1;
+
+		if (nand_chunk < 0) {
+			/* A hole reads as zeros */
+			memset(buffer + i * n_bytes, 0, n_bytes);
+			continue;
+		}
+
+		while (i + n_run < n_chunks &&
+		       n_run < YAFFS_MAX_MULTI_CHUNKS &&
+		       yaffs_find_chunk_in_file(in, inode_chunk + i + n_run,
+						NULL) == nand_chunk + n_run)
+			n_run++;
+
+		yaffs_rd_chunks_nand(dev, nand_chunk, n_run,
+				     buffer + i * n_bytes);
+	}
+}
+
 void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		     int lyn)
 {
@@ -3120,6 +3314,7 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 	    yaffs_write_new_chunk(dev, buffer, &new_tags, use_reserve);
 
 	if (new_chunk_id > 0) {
+		dev->n_host_writes++;
 		yaffs_put_chunk_in_file(in, inode_chunk, new_chunk_id, 0);
 
 		if (prev_chunk_id > 0)
@@ -3131,6 +3326,106 @@ static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 
 }
 
+/*
+ * Write a run of whole data chunks with one driver request.
+ * This only handles the easy case: the run has to fit in what is left of
+ * the current allocation block, and that block must already have passed
+ * its erased check. Returns the number of chunks written, or 0 if the
+ * caller should write them one at a time instead.
+ */
+static int yaffs_wr_data_obj_multi(struct yaffs_obj *in, int inode_chunk,
+				   int n_chunks, const u8 * buffer)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_ext_tags *tags = dev->multi_tags;
+	int prev_chunk_id[YAFFS_MAX_MULTI_CHUNKS];
+	int n_bytes = dev->data_bytes_per_chunk;
+	struct yaffs_block_info *bi;
+	int first_chunk = -1;
+	int chunk;
+	int c;
+
+	if (!dev->param.write_chunks_fn || dev->param.inband_tags ||
+	    dev->param.always_check_erased)
+		return 0;
+
+	if (n_chunks > YAFFS_MAX_MULTI_CHUNKS)
+		n_chunks = YAFFS_MAX_MULTI_CHUNKS;
+
+	yaffs_check_gc(dev, 0);
+
+	if (dev->alloc_block < 0)
+		return 0;
+
+	bi = yaffs_get_block_info(dev, dev->alloc_block);
+	if (!bi->skip_erased_check)
+		return 0;
+
+	if (n_chunks > dev->param.chunks_per_block - dev->alloc_page)
+		n_chunks = dev->param.chunks_per_block - dev->alloc_page;
+
+	if (n_chunks < 2 || !yaffs_check_alloc_available(dev, n_chunks))
+		return 0;
+
+	/* As yaffs_wr_data_obj(), make the tnodes now. The yaffs2 tags
+	 * have no serial number so there is no need to read the old tags.
+	 */
+	for (c = 0; c < n_chunks; c++) {
+		prev_chunk_id[c] =
+		    yaffs_find_chunk_in_file(in, inode_chunk + c, NULL);
+		if (prev_chunk_id[c] < 1 &&
+		    !yaffs_put_chunk_in_file(in, inode_chunk + c, 0, 0))
+			return 0;
+
+		yaffs_init_tags(&tags[c]);
+		tags[c].chunk_id = inode_chunk + c;
+		tags[c].obj_id = in->obj_id;
+		tags[c].serial_number = 1;
+		tags[c].n_bytes = n_bytes;
+	}
+
+	yaffs2_checkpt_invalidate(dev);
+
+	for (c = 0; c < n_chunks; c++) {
+		chunk = yaffs_alloc_chunk(dev, 0, NULL);
+		if (c == 0)
+			first_chunk = chunk;
+		if (chunk != first_chunk + c || chunk < 0) {
+			yaffs_trace(YAFFS_TRACE_ERROR,
+				"Multi-chunk allocation went wrong");
+			YBUG();
+		}
+	}
+
+	if (yaffs_wr_chunks_nand(dev, first_chunk, n_chunks, buffer, tags) !=
+	    YAFFS_OK) {
+		/* Treat it as a failed write of the first chunk, as
+		 * yaffs_write_new_chunk() would on a block that skips the
+		 * erased check: the block takes an error strike but is not
+		 * retired, and the caller retries chunk by chunk.
+		 */
+		for (c = 1; c < n_chunks; c++)
+			yaffs_chunk_del(dev, first_chunk + c, 1, __LINE__);
+		yaffs_handle_chunk_wr_error(dev, first_chunk, 0);
+		dev->n_retired_writes++;
+		return 0;
+	}
+
+	for (c = 0; c < n_chunks; c++) {
+		yaffs_handle_chunk_wr_ok(dev, first_chunk + c,
+					 buffer + c * n_bytes, &tags[c]);
+		dev->n_host_writes++;
+		yaffs_put_chunk_in_file(in, inode_chunk + c, first_chunk + c,
+					0);
+		if (prev_chunk_id[c] > 0)
+			yaffs_chunk_del(dev, prev_chunk_id[c], 1, __LINE__);
+	}
+
+	yaffs_verify_file_sane(in);
+
+	return n_chunks;
+}
+
 
 
 static int yaffs_do_xattrib_mod(struct yaffs_obj *obj, int set,
@@ -3497,6 +3792,7 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 
 		if (new_chunk_id >= 0) {
 
+			dev->n_host_writes++;
 			in->hdr_chunk = new_chunk_id;
 
 			if (prev_chunk_id > 0) {
@@ -3528,6 +3824,25 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 	return ret_val;
 }
 
+/*
+ * Copy a whole chunk out of the chunk cache if it is there.
+ * Returns 1 if it was, 0 if the caller has to read it from flash.
+ */
+int yaffs_rd_cached_chunk(struct yaffs_obj *in, int inode_chunk, u8 * buffer)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+
+	cache = yaffs_find_chunk_cache(in, inode_chunk);
+	if (!cache)
+		return 0;
+
+	yaffs_use_cache(dev, cache, 0);
+	memcpy(buffer, cache->data, dev->data_bytes_per_chunk);
+
+	return 1;
+}
+
 /*--------------------- File read/write ------------------------
  * Read and write have very similar structures.
  * In general the read/write has three parts to it
@@ -3581,13 +3896,10 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_assign(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3612,8 +3924,17 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 
 		} else {
 
-			/* A full chunk. Read directly into the supplied buffer. */
-			yaffs_rd_data_obj(in, chunk, buffer);
+			/* Full chunks. Read as many as are not cached
+			 * directly into the supplied buffer in one go.
+			 */
+			int n_run = n / dev->data_bytes_per_chunk;
+
+			if (n_run > YAFFS_MAX_MULTI_CHUNKS)
+				n_run = YAFFS_MAX_MULTI_CHUNKS;
+			n_run = 1 + yaffs_uncached_run(in, chunk + 1, n_run - 1);
+
+			yaffs_rd_data_obj_multi(in, chunk, n_run, buffer);
+			n_copy = n_run * dev->data_bytes_per_chunk;
 
 		}
 
@@ -3707,10 +4028,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_assign(dev, cache, in,
+							   chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3769,14 +4088,28 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 			}
 
 		} else {
-			/* A full chunk. Write directly from the supplied buffer. */
-
-			chunk_written =
-			    yaffs_wr_data_obj(in, chunk, buffer,
-					      dev->data_bytes_per_chunk, 0);
+			/* Full chunks. Write directly from the supplied buffer,
+			 * several at a time if the driver can take them.
+			 */
+			int n_run =
+			    yaffs_wr_data_obj_multi(in, chunk,
+						    n / dev->data_bytes_per_chunk,
+						    buffer);
+
+			if (n_run > 0) {
+				chunk_written = 1;
+				n_copy = n_run * dev->data_bytes_per_chunk;
+			} else {
+				n_run = 1;
+				chunk_written =
+				    yaffs_wr_data_obj(in, chunk, buffer,
+						      dev->data_bytes_per_chunk,
+						      0);
+			}
 
 			/* Since we've overwritten the cached data, we better invalidate it. */
-			yaffs_invalidate_chunk_cache(in, chunk);
+			while (n_run-- > 0)
+				yaffs_invalidate_chunk_cache(in, chunk + n_run);
 		}
 
 		if (chunk_written >= 0) {
@@ -4764,6 +5097,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	int init_failed = 0;
 	unsigned x;
 	int bits;
+	u64 t_start = Y_CLOCK_US();
+	u64 t_now;
 
 	yaffs_trace(YAFFS_TRACE_TRACING, "yaffs: yaffs_guts_initialise()" );
 
@@ -4776,6 +5111,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	spin_lock_init(&dev->read_state_lock);
+
 	dev->internal_start_block = dev->param.start_block;
 	dev->internal_end_block = dev->param.end_block;
 	dev->block_offset = 0;
@@ -4917,6 +5254,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
 	dev->gc_block_finder = 0;
+	dev->gc_score = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
 	dev->n_deleted_files = 0;
@@ -4933,44 +5271,31 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	INIT_LIST_HEAD(&dev->dirty_dirs);
 	dev->oldest_dirty_seq = 0;
 	dev->oldest_dirty_block = 0;
+	dev->mount_checkpt_us = 0;
+	dev->mount_query_us = 0;
+	dev->mount_sort_us = 0;
+	dev->mount_scan_us = 0;
+	dev->mount_fixup_us = 0;
+	dev->mount_total_us = 0;
+	dev->n_scan_batched = 0;
+	dev->n_scan_unbatched = 0;
+	dev->n_bg_checkpts = 0;
 
 	/* Initialise temporary buffers and caches. */
 	if (!yaffs_init_tmp_buffers(dev))
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
+	dev->cache_flush = NULL;
 	dev->gc_cleanup_list = NULL;
 
-	if (!init_failed && dev->param.n_caches > 0) {
-		int i;
-		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
-
-		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
-			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
-
-		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
-
-		buf = (u8 *) dev->cache;
-
-		if (dev->cache)
-			memset(dev->cache, 0, cache_bytes);
-
-		for (i = 0; i < dev->param.n_caches && buf; i++) {
-			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
-			dev->cache[i].dirty = 0;
-			dev->cache[i].data = buf =
-			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
-		}
-		if (!buf)
-			init_failed = 1;
-
-		dev->cache_last_use = 0;
-	}
+	if (!init_failed && dev->param.n_caches > 0 && !yaffs_init_cache(dev))
+		init_failed = 1;
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_evictions = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -4994,7 +5319,11 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	if (!init_failed) {
 		/* Now scan the flash. */
 		if (dev->param.is_yaffs2) {
-			if (yaffs2_checkpt_restore(dev)) {
+			int restored = yaffs2_checkpt_restore(dev);
+
+			t_now = Y_CLOCK_US();
+			dev->mount_checkpt_us = t_now - t_start;
+			if (restored) {
 				yaffs_check_obj_details_loaded(dev->root_dir);
 				yaffs_trace(YAFFS_TRACE_CHECKPOINT | YAFFS_TRACE_MOUNT,
 					"yaffs: restored from checkpoint"
@@ -5032,10 +5361,12 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 			init_failed = 1;
                 }
 
+		t_now = Y_CLOCK_US();
 		yaffs_strip_deleted_objs(dev);
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
 			yaffs_empty_l_n_f(dev);
+		dev->mount_fixup_us += Y_CLOCK_US() - t_now;
 	}
 
 	if (init_failed) {
@@ -5052,6 +5383,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->n_page_writes = 0;
 	dev->n_erasures = 0;
 	dev->n_gc_copies = 0;
+	dev->n_host_writes = 0;
 	dev->n_retired_writes = 0;
 
 	dev->n_retired_blocks = 0;
@@ -5063,6 +5395,13 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	if (!dev->is_checkpointed && dev->blocks_in_checkpt > 0)
 		yaffs2_checkpt_invalidate(dev);
 
+	dev->mount_total_us = Y_CLOCK_US() - t_start;
+	yaffs_trace(YAFFS_TRACE_MOUNT,
+		"mount took %u us: checkpoint %u, query %u, sort %u, scan %u, fixup %u",
+		dev->mount_total_us, dev->mount_checkpt_us,
+		dev->mount_query_us, dev->mount_sort_us,
+		dev->mount_scan_us, dev->mount_fixup_us);
+
 	yaffs_trace(YAFFS_TRACE_TRACING,
 	  "yaffs: yaffs_guts_initialise() done.");
 	return YAFFS_OK;
@@ -5076,17 +5415,7 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 
 		yaffs_deinit_blocks(dev);
 		yaffs_deinit_tnodes_and_objs(dev);
-		if (dev->param.n_caches > 0 && dev->cache) {
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].data)
-					kfree(dev->cache[i].data);
-				dev->cache[i].data = NULL;
-			}
-
-			kfree(dev->cache);
-			dev->cache = NULL;
-		}
+		yaffs_deinit_cache(dev);
 
 		kfree(dev->gc_cleanup_list);
 
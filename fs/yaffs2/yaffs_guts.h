@@ -83,10 +83,13 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Most chunks passed to the driver in one multi-chunk read or write */
+#define YAFFS_MAX_MULTI_CHUNKS		8
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -110,11 +113,12 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
 	u8 *data;
+	struct list_head hash_link;	/* In dev->cache_hash while in use */
+	struct list_head lru;	/* On dev->cache_lru, most recent first */
 };
 
 /* Tags structures in RAM
@@ -524,6 +528,9 @@ struct yaffs_param {
 
 	int enable_xattr;	/* Enable xattribs */
 
+	/* Garbage collection policy (yaffs2) */
+	int gc_cost_benefit;	/* Pick gc victims by cost-benefit, not just dirtiness */
+
 	/* NAND access functions (Must be set before calling YAFFS) */
 
 	int (*write_chunk_fn) (struct yaffs_dev * dev,
@@ -547,6 +554,20 @@ struct yaffs_param {
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
 			       u32 * seq_number);
+	/* Optional: read the tags of every chunk in a block in one go.
+	 * Must not touch the device state since the scan runs it
+	 * asynchronously.
+	 */
+	int (*read_block_tags_fn) (struct yaffs_dev * dev, int block_no,
+				   struct yaffs_ext_tags * tags);
+	/* Optional: read or write a run of n_chunks consecutive chunks as
+	 * one request, data back to back in the buffer. No inband tags.
+	 */
+	int (*read_chunks_fn) (struct yaffs_dev * dev, int nand_chunk,
+			       int n_chunks, u8 * data);
+	int (*write_chunks_fn) (struct yaffs_dev * dev, int nand_chunk,
+				int n_chunks, const u8 * data,
+				const struct yaffs_ext_tags * tags);
 #endif
 
 	/* The remove_obj_fn function must be supplied by OS flavours that
@@ -671,6 +692,10 @@ struct yaffs_dev {
 	unsigned gc_block;
 	unsigned gc_chunk;
 	unsigned gc_skip;
+	u32 gc_score;		/* Score of gc_dirtiest */
+
+	/* Tags for a multi-chunk write, only used under the exclusive lock */
+	struct yaffs_ext_tags multi_tags[YAFFS_MAX_MULTI_CHUNKS];
 
 	/* Special directories */
 	struct yaffs_obj *root_dir;
@@ -685,7 +710,11 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	unsigned cache_alt:1;	/* cache was allocated using alternative strategy */
+	struct list_head *cache_hash;	/* Entries in use, by (obj_id, chunk_id) */
+	u32 cache_hash_bits;
+	struct list_head cache_lru;	/* All entries, free ones at the tail */
+	struct yaffs_cache **cache_flush;	/* Scratch for yaffs_flush_file_cache() */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -713,6 +742,12 @@ struct yaffs_dev {
 	/* Dirty directory handling */
 	struct list_head dirty_dirs;	/* List of dirty directories */
 
+	/*
+	 * Readers holding the device shared still count their reads and
+	 * handle ECC errors, so those updates are made under this lock.
+	 */
+	spinlock_t read_state_lock;
+
 	/* Statistcs */
 	u32 n_page_writes;
 	u32 n_page_reads;
@@ -734,6 +769,25 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_evictions;
+	u32 n_host_writes;	/* Chunks written for the user, as opposed to gc */
+
+	/* Mount timing, in microseconds */
+	u32 mount_checkpt_us;	/* Checkpoint restore (or failed attempt) */
+	u32 mount_query_us;	/* Scan: block state query */
+	u32 mount_sort_us;	/* Scan: sorting blocks by sequence number */
+	u32 mount_scan_us;	/* Scan: reading and processing the tags */
+	u32 mount_fixup_us;	/* Hard links, deleted and hanging objects */
+	u32 mount_total_us;
+	u32 n_scan_batched;	/* Blocks whose tags were read in one go */
+	u32 n_scan_unbatched;	/* Blocks that fell back to chunk reads */
+	u32 n_bg_checkpts;	/* Checkpoints written while idle */
+	u32 n_multi_reads;	/* Multi-chunk read requests */
+	u32 n_multi_read_chunks;
+	u32 n_multi_read_fails;	/* Fell back to chunk by chunk reads */
+	u32 n_multi_writes;	/* Multi-chunk write requests */
+	u32 n_multi_write_chunks;
 
 };
 
@@ -801,6 +855,21 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+
+/*
+ * Whole chunk reads that neither allocate cache entries nor write, for
+ * callers that do not hold the device exclusively. yaffs_rd_cached_chunk()
+ * updates the cache LRU, so such callers must still serialise it. Flash
+ * reads update the read counters and, on ECC errors, the block's GC and
+ * retirement state; both are done under dev->read_state_lock.
+ */
+void yaffs_addr_to_chunk(struct yaffs_dev *dev, loff_t addr,
+			 int *chunk_out, u32 * offset_out);
+int yaffs_rd_cached_chunk(struct yaffs_obj *obj, int inode_chunk,
+			  u8 * buffer);
+int yaffs_rd_data_obj(struct yaffs_obj *obj, int inode_chunk, u8 * buffer);
+void yaffs_rd_data_obj_multi(struct yaffs_obj *obj, int inode_chunk,
+			     int n_chunks, u8 * buffer);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
@@ -867,6 +936,14 @@ void yaffs_guts_test(struct yaffs_dev *dev);
 void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		     int lyn);
 int yaffs_check_ff(u8 * buffer, int n_bytes);
+static inline void yaffs_add_read_stat(struct yaffs_dev *dev, u32 *stat,
+				       u32 n)
+{
+	spin_lock(&dev->read_state_lock);
+	*stat += n;
+	spin_unlock(&dev->read_state_lock);
+}
+
 void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 			      struct yaffs_block_info *bi);
 
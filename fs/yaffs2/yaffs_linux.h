@@ -18,16 +18,29 @@
 
 #include "yportenv.h"
 
+struct yaffs_lock_stats {
+	u32 acquired;
+	u32 contended;		/* acquisitions that had to wait */
+	u64 wait_ns;		/* total time spent waiting */
+	u64 max_wait_ns;	/* longest single wait */
+};
+
 struct yaffs_linux_context {
 	struct list_head context_list;	/* List of these we have mounted */
 	struct yaffs_dev *dev;
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	struct rw_semaphore meta_lock;	/* Objects, tnodes and block state */
+	struct mutex cache_lock;	/* Chunk cache, for shared holders */
+	spinlock_t lock_stats_lock;
+	struct yaffs_lock_stats meta_excl_stats;
+	struct yaffs_lock_stats meta_shared_stats;
+	struct yaffs_lock_stats cache_stats;
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+	u8 *multi_oob;		/* Packed tags for mtdif2 multi-chunk writes */
 	struct list_head search_contexts;
 	void (*put_super_fn) (struct super_block * sb);
 
@@ -180,12 +180,12 @@ int nandmtd1_read_chunk_tags(struct yaffs_dev *dev,
 	case -EUCLEAN:
 		/* MTD's ECC fixed the data */
 		eccres = YAFFS_ECC_RESULT_FIXED;
-		dev->n_ecc_fixed++;
+		yaffs_add_read_stat(dev, &dev->n_ecc_fixed, 1);
 		break;
 
 	case -EBADMSG:
 		/* MTD's ECC could not fix the data */
-		dev->n_ecc_unfixed++;
+		yaffs_add_read_stat(dev, &dev->n_ecc_unfixed, 1);
 		/* fall into... */
 	default:
 		rettags(etags, YAFFS_ECC_RESULT_UNFIXED, 0);
@@ -219,13 +219,13 @@ int nandmtd1_read_chunk_tags(struct yaffs_dev *dev,
 		break;
 	case 1:
 		/* recovered tags-ECC error */
-		dev->n_tags_ecc_fixed++;
+		yaffs_add_read_stat(dev, &dev->n_tags_ecc_fixed, 1);
 		if (eccres == YAFFS_ECC_RESULT_NO_ERROR)
 			eccres = YAFFS_ECC_RESULT_FIXED;
 		break;
 	default:
 		/* unrecovered tags-ECC error */
-		dev->n_tags_ecc_unfixed++;
+		yaffs_add_read_stat(dev, &dev->n_tags_ecc_unfixed, 1);
 		return rettags(etags, YAFFS_ECC_RESULT_UNFIXED, YAFFS_FAIL);
 	}
 
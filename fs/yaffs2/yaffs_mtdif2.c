@@ -125,7 +125,8 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		ops.len = data ? dev->data_bytes_per_chunk : packed_tags_size;
 		ops.ooboffs = 0;
 		ops.datbuf = data;
-		ops.oobbuf = yaffs_dev_to_lc(dev)->spare_buffer;
+		/* Straight into pt: the read may run concurrently */
+		ops.oobbuf = packed_tags_ptr;
 		retval = mtd->read_oob(mtd, addr, &ops);
 	}
 
@@ -138,12 +139,8 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			yaffs_unpack_tags2_tags_only(tags, pt2tp);
 		}
 	} else {
-		if (tags) {
-			memcpy(packed_tags_ptr,
-			       yaffs_dev_to_lc(dev)->spare_buffer,
-			       packed_tags_size);
+		if (tags)
 			yaffs_unpack_tags2(tags, &pt, !dev->param.no_tags_ecc);
-		}
 	}
 
 	if (local_data)
@@ -152,12 +149,12 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 	if (tags && retval == -EBADMSG
 	    && tags->ecc_result == YAFFS_ECC_RESULT_NO_ERROR) {
 		tags->ecc_result = YAFFS_ECC_RESULT_UNFIXED;
-		dev->n_ecc_unfixed++;
+		yaffs_add_read_stat(dev, &dev->n_ecc_unfixed, 1);
 	}
 	if (tags && retval == -EUCLEAN
 	    && tags->ecc_result == YAFFS_ECC_RESULT_NO_ERROR) {
 		tags->ecc_result = YAFFS_ECC_RESULT_FIXED;
-		dev->n_ecc_fixed++;
+		yaffs_add_read_stat(dev, &dev->n_ecc_fixed, 1);
 	}
 	if (retval == 0)
 		return YAFFS_OK;
@@ -165,6 +162,150 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+/*
+ * Read the tags of every chunk in a block with a single multi-page oob
+ * read. With MTD_OOB_AUTO the driver packs oobavail bytes per page
+ * back to back. The driver only reports ECC events for the request as a
+ * whole, so any ECC event fails the lot and the caller re-reads the block
+ * chunk by chunk to find out which chunk it was.
+ */
+int nandmtd2_read_block_tags(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	struct mtd_oob_ops ops;
+	int n_chunks = dev->param.chunks_per_block;
+	int stride = mtd->oobavail;
+	int retval;
+	int c;
+	u8 *buf;
+
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_read_block_tags block %d", block_no);
+
+	if (dev->param.inband_tags || stride < packed_tags_size)
+		return YAFFS_FAIL;
+
+	buf = kmalloc(n_chunks * stride, GFP_NOFS);
+	if (!buf)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = n_chunks * stride;
+	ops.len = 0;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = buf;
+	retval = mtd->read_oob(mtd, ((loff_t) block_no) * n_chunks *
+			       dev->param.total_bytes_per_chunk, &ops);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (c = 0; c < n_chunks; c++) {
+			memcpy(packed_tags_ptr, buf + c * stride,
+			       packed_tags_size);
+			yaffs_unpack_tags2(&tags[c], &pt,
+					   !dev->param.no_tags_ecc);
+		}
+	}
+
+	kfree(buf);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
+/*
+ * Read the data of a run of consecutive chunks with a single request so
+ * that the driver can stream the pages (OneNAND superload, for instance).
+ * As with the block tags read, an ECC event can't be pinned on a chunk so
+ * it fails the run and the caller goes back to chunk by chunk reads.
+ */
+int nandmtd2_read_chunks(struct yaffs_dev *dev, int nand_chunk, int n_chunks,
+			 u8 * data)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	size_t len = n_chunks * dev->param.total_bytes_per_chunk;
+	size_t retlen = 0;
+	int retval;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_read_chunks chunk %d n %d data %p",
+		nand_chunk, n_chunks, data);
+
+	if (dev->param.inband_tags)
+		return YAFFS_FAIL;
+
+	retval = mtd->read(mtd,
+			   ((loff_t) nand_chunk) *
+			   dev->param.total_bytes_per_chunk, len, &retlen,
+			   data);
+
+	if (retval == 0 && retlen == len)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
+/*
+ * Write a run of consecutive chunks with a single request. With
+ * MTD_OOB_AUTO the driver takes oobavail bytes of oob per page, so the
+ * packed tags for each chunk go at a stride of oobavail.
+ */
+int nandmtd2_write_chunks(struct yaffs_dev *dev, int nand_chunk, int n_chunks,
+			  const u8 * data, const struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	u8 *oob = yaffs_dev_to_lc(dev)->multi_oob;
+	struct mtd_oob_ops ops;
+	int stride = mtd->oobavail;
+	int retval;
+	int c;
+
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_write_chunks chunk %d n %d data %p",
+		nand_chunk, n_chunks, data);
+
+	if (!data || !tags || !oob || dev->param.inband_tags ||
+	    stride < packed_tags_size || n_chunks > YAFFS_MAX_MULTI_CHUNKS)
+		BUG();
+
+	memset(oob, 0xff, n_chunks * stride);
+	for (c = 0; c < n_chunks; c++) {
+		yaffs_pack_tags2(&pt, &tags[c], !dev->param.no_tags_ecc);
+		memcpy(oob + c * stride, packed_tags_ptr, packed_tags_size);
+	}
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = n_chunks * stride;
+	ops.len = n_chunks * dev->param.total_bytes_per_chunk;
+	ops.ooboffs = 0;
+	ops.datbuf = (u8 *) data;
+	ops.oobbuf = oob;
+	retval = mtd->write_oob(mtd, ((loff_t) nand_chunk) *
+				dev->param.total_bytes_per_chunk, &ops);
+
+	if (retval == 0 && ops.retlen == ops.len)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no)
 {
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
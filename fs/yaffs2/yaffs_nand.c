@@ -25,7 +25,7 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 
 	int realigned_chunk = nand_chunk - dev->chunk_offset;
 
-	dev->n_page_reads++;
+	yaffs_add_read_stat(dev, &dev->n_page_reads, 1);
 
 	/* If there are no tags provided, use local tags to get prioritised gc working */
 	if (!tags)
@@ -50,6 +50,94 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/*
+ * Read the tags of a whole block with one driver request.
+ * This only touches the driver, so it is safe to run from a worker while
+ * the scan carries on with another block. Returns YAFFS_FAIL if the driver
+ * can't do it or if the result can't be trusted chunk by chunk.
+ */
+int yaffs_fetch_block_tags(struct yaffs_dev *dev, int block_no,
+			   struct yaffs_ext_tags *tags)
+{
+	if (!dev->param.read_block_tags_fn || dev->param.inband_tags)
+		return YAFFS_FAIL;
+
+	return dev->param.read_block_tags_fn(dev, block_no - dev->block_offset,
+					     tags);
+}
+
+/*
+ * Fill in tags[] for every chunk in the block.
+ * If fetched is set then yaffs_fetch_block_tags() has already done the
+ * reading and we just do the book keeping, otherwise read chunk by chunk.
+ */
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags, int fetched)
+{
+	int n_chunks = dev->param.chunks_per_block;
+	int first_chunk = block_no * n_chunks;
+	struct yaffs_block_info *bi;
+	int result = YAFFS_OK;
+	int c;
+
+	if (!fetched) {
+		dev->n_scan_unbatched++;
+		for (c = 0; c < n_chunks; c++)
+			if (yaffs_rd_chunk_tags_nand(dev, first_chunk + c,
+						     NULL, &tags[c]) !=
+			    YAFFS_OK)
+				result = YAFFS_FAIL;
+		return result;
+	}
+
+	dev->n_scan_batched++;
+	yaffs_add_read_stat(dev, &dev->n_page_reads, n_chunks);
+
+	bi = yaffs_get_block_info(dev, block_no);
+	for (c = 0; c < n_chunks; c++)
+		if (tags[c].ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+			yaffs_handle_chunk_error(dev, bi);
+
+	return result;
+}
+
+/*
+ * Read the data of n_chunks consecutive chunks into buffer.
+ * The driver gets the whole run as one request if it can take it. It can't
+ * tell us which chunk an ECC event belongs to, so if anything goes wrong
+ * we read the run again chunk by chunk and let the usual handling sort it.
+ */
+int yaffs_rd_chunks_nand(struct yaffs_dev *dev, int nand_chunk,
+			 int n_chunks, u8 * buffer)
+{
+	int result = YAFFS_OK;
+	int c;
+
+	if (n_chunks > 1 && dev->param.read_chunks_fn &&
+	    !dev->param.inband_tags) {
+		if (dev->param.read_chunks_fn(dev,
+					      nand_chunk - dev->chunk_offset,
+					      n_chunks, buffer) == YAFFS_OK) {
+			spin_lock(&dev->read_state_lock);
+			dev->n_page_reads += n_chunks;
+			dev->n_multi_reads++;
+			dev->n_multi_read_chunks += n_chunks;
+			spin_unlock(&dev->read_state_lock);
+			return YAFFS_OK;
+		}
+		yaffs_add_read_stat(dev, &dev->n_multi_read_fails, 1);
+	}
+
+	for (c = 0; c < n_chunks; c++)
+		if (yaffs_rd_chunk_tags_nand(dev, nand_chunk + c,
+					     buffer +
+					     c * dev->data_bytes_per_chunk,
+					     NULL) != YAFFS_OK)
+			result = YAFFS_FAIL;
+
+	return result;
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags)
@@ -81,6 +169,37 @@ int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 		return yaffs_tags_compat_wr(dev, nand_chunk, buffer, tags);
 }
 
+/*
+ * Write n_chunks consecutive chunks with one driver request.
+ * Only called when write_chunks_fn is set and the chunks are known erased.
+ */
+int yaffs_wr_chunks_nand(struct yaffs_dev *dev, int nand_chunk,
+			 int n_chunks, const u8 * buffer,
+			 struct yaffs_ext_tags *tags)
+{
+	int c;
+
+	dev->n_page_writes += n_chunks;
+	dev->n_multi_writes++;
+	dev->n_multi_write_chunks += n_chunks;
+
+	for (c = 0; c < n_chunks; c++) {
+		tags[c].seq_number = dev->seq_number;
+		tags[c].chunk_used = 1;
+		if (!yaffs_validate_tags(&tags[c])) {
+			yaffs_trace(YAFFS_TRACE_ERROR, "Writing uninitialised tags");
+			YBUG();
+		}
+	}
+
+	yaffs_trace(YAFFS_TRACE_WRITE,
+		"Writing chunks %d..%d obj %d",
+		nand_chunk, nand_chunk + n_chunks - 1, tags[0].obj_id);
+
+	return dev->param.write_chunks_fn(dev, nand_chunk - dev->chunk_offset,
+					  n_chunks, buffer, tags);
+}
+
 int yaffs_mark_bad(struct yaffs_dev *dev, int block_no)
 {
 	block_no -= dev->block_offset;
@@ -97,6 +97,9 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_checkpoint = 30;
+unsigned int yaffs_gc_policy = 1;
+unsigned int yaffs_multi_chunk = 1;
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -104,6 +107,9 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_checkpoint, uint, 0644);
+module_param(yaffs_gc_policy, uint, 0644);
+module_param(yaffs_multi_chunk, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -121,17 +127,95 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 	return yaffs_gc_control;
 }
 
-static void yaffs_gross_lock(struct yaffs_dev *dev)
+/*
+ * Locking.
+ *
+ * meta_lock covers the objects, tnodes, block and allocator state and
+ * everything else in yaffs_guts. Anything that may change that state,
+ * including garbage collection, takes it exclusively.
+ *
+ * Reading whole chunks that are already on flash changes almost none of
+ * it, so yaffs_readpage() takes meta_lock shared and readers no longer
+ * queue up behind one another. Shared holders serialise the chunk cache
+ * LRU and the free space calculation on cache_lock, which exclusive
+ * holders do not need. The read counters and the GC and retirement
+ * state that an ECC error changes are updated under the device's
+ * read_state_lock spinlock, by shared and exclusive holders alike.
+ *
+ * Time spent waiting for each lock is accounted and shown in /proc/yaffs.
+ */
+static void yaffs_lock_account(struct yaffs_dev *dev,
+			       struct yaffs_lock_stats *stats, u64 start)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u64 waited = start ? local_clock() - start : 0;
+
+	spin_lock(&lc->lock_stats_lock);
+	stats->acquired++;
+	if (start) {
+		stats->contended++;
+		stats->wait_ns += waited;
+		if (waited > stats->max_wait_ns)
+			stats->max_wait_ns = waited;
+	}
+	spin_unlock(&lc->lock_stats_lock);
+}
+
+static void yaffs_meta_lock(struct yaffs_dev *dev)
 {
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u64 start = 0;
+
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	if (!down_write_trylock(&lc->meta_lock)) {
+		start = local_clock();
+		down_write(&lc->meta_lock);
+	}
+	yaffs_lock_account(dev, &lc->meta_excl_stats, start);
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
-static void yaffs_gross_unlock(struct yaffs_dev *dev)
+static void yaffs_meta_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&yaffs_dev_to_lc(dev)->meta_lock);
+}
+
+static void yaffs_meta_lock_shared(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u64 start = 0;
+
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs shared locking %p", current);
+	if (!down_read_trylock(&lc->meta_lock)) {
+		start = local_clock();
+		down_read(&lc->meta_lock);
+	}
+	yaffs_lock_account(dev, &lc->meta_shared_stats, start);
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs shared locked %p", current);
+}
+
+static void yaffs_meta_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs shared unlocking %p", current);
+	up_read(&yaffs_dev_to_lc(dev)->meta_lock);
+}
+
+static void yaffs_cache_lock(struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	u64 start = 0;
+
+	if (!mutex_trylock(&lc->cache_lock)) {
+		start = local_clock();
+		mutex_lock(&lc->cache_lock);
+	}
+	yaffs_lock_account(dev, &lc->cache_stats, start);
+}
+
+static void yaffs_cache_unlock(struct yaffs_dev *dev)
+{
+	mutex_unlock(&yaffs_dev_to_lc(dev)->cache_lock);
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -156,13 +240,13 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -197,7 +281,7 @@ struct inode *yaffs_get_inode(struct super_block *sb, int mode, int dev,
 
 	/* NB Side effect: iget calls back to yaffs_read_inode(). */
 	/* iget also increments the inode's i_count */
-	/* NB You can't be holding gross_lock or deadlock will happen! */
+	/* NB You can't be holding meta_lock or deadlock will happen! */
 
 	return inode;
 }
@@ -226,13 +310,13 @@ static int yaffs_init_security(struct inode *dir, struct dentry *dentry,
 
 	/* inlined yaffs_setxattr: no instantiated dentry yet */
 	dev = obj->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	result = yaffs_set_xattrib(obj, name, value, size, 0);
 	if (result == YAFFS_OK)
 		err = 0;
 	else if (result < 0)
 		err = result;
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	kfree(value);
 	kfree(suffix);
@@ -280,7 +364,7 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 
 	dev = parent->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	switch (mode & S_IFMT) {
 	default:
@@ -306,8 +390,8 @@ static int yaffs_mknod(struct inode *dir, struct dentry *dentry, int mode,
 		break;
 	}
 
-	/* Can not call yaffs_get_inode() with gross lock held */
-	yaffs_gross_unlock(dev);
+	/* Can not call yaffs_get_inode() with meta lock held */
+	yaffs_meta_unlock(dev);
 
 	if (obj) {
 		inode = yaffs_get_inode(dir->i_sb, mode, rdev, obj);
@@ -351,7 +435,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 	obj = yaffs_inode_to_obj(inode);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	if (!S_ISDIR(inode->i_mode))	/* Don't link directories */
 		link =
@@ -368,7 +452,7 @@ static int yaffs_link(struct dentry *old_dentry, struct inode *dir,
 			atomic_read(&old_dentry->d_inode->i_count));
 	}
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (link) {
 		update_dir_time(dir);
@@ -390,10 +474,10 @@ static int yaffs_symlink(struct inode *dir, struct dentry *dentry,
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_symlink");
 
 	dev = yaffs_inode_to_obj(dir)->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	obj = yaffs_create_symlink(yaffs_inode_to_obj(dir), dentry->d_name.name,
 				   S_IFLNK | S_IRWXUGO, uid, gid, symname);
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (obj) {
 		struct inode *inode;
@@ -420,7 +504,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
 
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_lookup for %d:%s",
@@ -430,9 +514,9 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 
 	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
+	/* Can't hold meta lock when calling yaffs_get_inode() */
 	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -470,19 +554,19 @@ static int yaffs_unlink(struct inode *dir, struct dentry *dentry)
 	obj = yaffs_inode_to_obj(dir);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	ret_val = yaffs_unlinker(obj, dentry->d_name.name);
 
 	if (ret_val == YAFFS_OK) {
 		dentry->d_inode->i_nlink--;
 		dir->i_version++;
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		mark_inode_dirty(dentry->d_inode);
 		update_dir_time(dir);
 		return 0;
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	return -ENOTEMPTY;
 }
 
@@ -498,9 +582,9 @@ static int yaffs_sync_object(struct file *file, int datasync)
 	dev = obj->my_dev;
 
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC, "yaffs_sync_object");
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	yaffs_flush_file(obj, 1, datasync);
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	return 0;
 }
 /*
@@ -518,7 +602,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_rename");
 	dev = yaffs_inode_to_obj(old_dir)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	/* Check if the target is an existing directory that is not empty. */
 	target = yaffs_find_by_name(yaffs_inode_to_obj(new_dir),
@@ -539,7 +623,7 @@ static int yaffs_rename(struct inode *old_dir, struct dentry *old_dentry,
 					   yaffs_inode_to_obj(new_dir),
 					   new_dentry->d_name.name);
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (ret_val == YAFFS_OK) {
 		if (target) {
@@ -588,14 +672,14 @@ static int yaffs_setattr(struct dentry *dentry, struct iattr *attr)
 					   (int)(attr->ia_size),
 					   (int)(attr->ia_size));
 		}
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		result = yaffs_set_attribs(yaffs_inode_to_obj(inode), attr);
 		if (result == YAFFS_OK) {
 			error = 0;
 		} else {
 			error = -EPERM;
 		}
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 
@@ -618,13 +702,13 @@ static int yaffs_setxattr(struct dentry *dentry, const char *name,
 	if (error == 0) {
 		int result;
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		result = yaffs_set_xattrib(obj, name, value, size, flags);
 		if (result == YAFFS_OK)
 			error = 0;
 		else if (result < 0)
 			error = result;
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_setxattr done returning %d", error);
@@ -646,9 +730,9 @@ static ssize_t yaffs_getxattr(struct dentry * dentry, const char *name, void *bu
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		error = yaffs_get_xattrib(obj, name, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_getxattr done returning %d", error);
@@ -669,13 +753,13 @@ static int yaffs_removexattr(struct dentry *dentry, const char *name)
 	if (error == 0) {
 		int result;
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		result = yaffs_remove_xattrib(obj, name);
 		if (result == YAFFS_OK)
 			error = 0;
 		else if (result < 0)
 			error = result;
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -696,9 +780,9 @@ static ssize_t yaffs_listxattr(struct dentry * dentry, char *buff, size_t size)
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		error = yaffs_list_xattrib(obj, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -856,7 +940,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_dev_to_lc(dev)->readdir_process = current;
 
@@ -875,12 +959,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry . ino %d",
 			(int)inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_meta_lock(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -888,14 +972,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry .. ino %d",
 			(int)f->f_dentry->d_parent->d_inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 		if (filldir(dirent, "..", 2, offset,
 			    f->f_dentry->d_parent->d_inode->i_ino,
 			    DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_meta_lock(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -922,17 +1006,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
-			yaffs_gross_unlock(dev);
+			yaffs_meta_unlock(dev);
 
 			if (filldir(dirent,
 				    name,
 				    strlen(name),
 				    offset, this_inode, this_type) < 0) {
-				yaffs_gross_lock(dev);
+				yaffs_meta_lock(dev);
 				goto out;
 			}
 
-			yaffs_gross_lock(dev);
+			yaffs_meta_lock(dev);
 
 			offset++;
 			f->f_pos++;
@@ -943,7 +1027,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 out:
 	yaffs_search_end(sc);
 	yaffs_dev_to_lc(dev)->readdir_process = NULL;
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	return ret_val;
 }
@@ -967,11 +1051,11 @@ static int yaffs_file_flush(struct file *file, fl_owner_t id)
 	  	"yaffs_file_flush object %d (%s)",
 		obj->obj_id, obj->dirty ? "dirty" : "clean");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_flush_file(obj, 1, 0);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	return 0;
 }
@@ -1067,11 +1151,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -1087,10 +1171,10 @@ static void *yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	void *ret;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	if (!alias) {
 		ret = ERR_PTR(-ENOMEM);
@@ -1149,15 +1233,15 @@ static void yaffs_evict_inode(struct inode *inode)
 
 	if (deleteme && obj) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		yaffs_del_obj(obj);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 	}
 	if (obj) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_meta_lock(dev);
 		yaffs_unstitch_obj(inode, obj);
-		yaffs_gross_unlock(dev);
+		yaffs_meta_unlock(dev);
 	}
 
 }
@@ -1171,6 +1255,57 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 		sb->s_dirt = 1;
 }
 
+/*
+ * Read whole pages made up of whole chunks with meta_lock only held shared.
+ * Runs of chunks that are not in the cache are read in one go.
+ * Returns -1 if the pages need the chunk cache instead, which could mean
+ * flushing dirty cache entries to flash.
+ */
+static int yaffs_readpages_shared(struct yaffs_obj *obj, u8 *buf,
+				  loff_t pos, int len)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int chunk_size = dev->data_bytes_per_chunk;
+	u8 *run_buf = NULL;
+	int run_chunk = 0;
+	int n_run = 0;
+	int n_done;
+	int chunk;
+	u32 start;
+	int hit;
+
+	if (dev->param.inband_tags || (PAGE_CACHE_SIZE % chunk_size))
+		return -1;
+
+	yaffs_meta_lock_shared(dev);
+
+	for (n_done = 0; n_done < len; n_done += chunk_size) {
+		yaffs_addr_to_chunk(dev, pos + n_done, &chunk, &start);
+		chunk++;
+
+		yaffs_cache_lock(dev);
+		hit = yaffs_rd_cached_chunk(obj, chunk, buf + n_done);
+		yaffs_cache_unlock(dev);
+
+		if (!hit && n_run++ == 0) {
+			run_chunk = chunk;
+			run_buf = buf + n_done;
+		}
+
+		if (n_run && (hit || n_run == YAFFS_MAX_MULTI_CHUNKS)) {
+			yaffs_rd_data_obj_multi(obj, run_chunk, n_run, run_buf);
+			n_run = 0;
+		}
+	}
+
+	if (n_run)
+		yaffs_rd_data_obj_multi(obj, run_chunk, n_run, run_buf);
+
+	yaffs_meta_unlock_shared(dev);
+
+	return len;
+}
+
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
 	/* Lifted from jffs2 */
@@ -1195,12 +1330,19 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	ret = yaffs_readpages_shared(obj, pg_buf,
+				     (loff_t)pg->index << PAGE_CACHE_SHIFT,
+				     PAGE_CACHE_SIZE);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	if (ret < 0) {
+		yaffs_meta_lock(dev);
 
-	yaffs_gross_unlock(dev);
+		ret = yaffs_file_rd(obj, pg_buf,
+				    pg->index << PAGE_CACHE_SHIFT,
+				    PAGE_CACHE_SIZE);
+
+		yaffs_meta_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1237,6 +1379,88 @@ static int yaffs_readpage(struct file *f, struct page *pg)
 	return ret;
 }
 
+/*
+ * Read a run of pages with consecutive indices through a bounce buffer,
+ * so that the chunks behind them can go to the driver as one request.
+ * Without a buffer, or if the pages need the chunk cache, fall back to
+ * reading them one at a time.
+ */
+static void yaffs_readpages_run(struct file *f, struct page **pages,
+				int n_pages, u8 *buf)
+{
+	struct yaffs_obj *obj = yaffs_dentry_to_obj(f->f_dentry);
+	int ret = -1;
+	int i;
+
+	if (buf && n_pages > 1)
+		ret = yaffs_readpages_shared(obj, buf,
+					     (loff_t)pages[0]->index <<
+					     PAGE_CACHE_SHIFT,
+					     n_pages * PAGE_CACHE_SIZE);
+
+	for (i = 0; i < n_pages; i++) {
+		if (ret < 0) {
+			yaffs_readpage_unlock(f, pages[i]);
+		} else {
+			memcpy(kmap(pages[i]), buf + i * PAGE_CACHE_SIZE,
+			       PAGE_CACHE_SIZE);
+			flush_dcache_page(pages[i]);
+			kunmap(pages[i]);
+			SetPageUptodate(pages[i]);
+			UnlockPage(pages[i]);
+		}
+		page_cache_release(pages[i]);
+	}
+}
+
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+			   struct list_head *page_list, unsigned nr_pages)
+{
+	struct yaffs_obj *obj = yaffs_dentry_to_obj(f->f_dentry);
+	struct yaffs_dev *dev = obj->my_dev;
+	struct page *pages[YAFFS_MAX_MULTI_CHUNKS];
+	int max_pages = YAFFS_MAX_MULTI_CHUNKS * dev->data_bytes_per_chunk /
+	    PAGE_CACHE_SIZE;
+	int n_pages = 0;
+	u8 *buf = NULL;
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages %u", nr_pages);
+
+	if (max_pages > 1 && nr_pages > 1 && dev->param.read_chunks_fn)
+		buf = kmalloc(max_pages * PAGE_CACHE_SIZE,
+			      GFP_NOFS | __GFP_NOWARN);
+	if (max_pages > YAFFS_MAX_MULTI_CHUNKS)
+		max_pages = YAFFS_MAX_MULTI_CHUNKS;
+	if (!buf)
+		max_pages = 1;
+
+	while (!list_empty(page_list)) {
+		struct page *pg = list_entry(page_list->prev, struct page, lru);
+
+		list_del(&pg->lru);
+		if (add_to_page_cache_lru(pg, mapping, pg->index, GFP_KERNEL)) {
+			page_cache_release(pg);
+			continue;
+		}
+
+		if (n_pages &&
+		    (n_pages == max_pages ||
+		     pages[n_pages - 1]->index + 1 != pg->index)) {
+			yaffs_readpages_run(f, pages, n_pages, buf);
+			n_pages = 0;
+		}
+		pages[n_pages++] = pg;
+	}
+
+	if (n_pages)
+		yaffs_readpages_run(f, pages, n_pages, buf);
+
+	kfree(buf);
+
+	yaffs_trace(YAFFS_TRACE_OS, "yaffs_readpages done");
+	return 0;
+}
+
 /* writepage inspired by/stolen from smbfs */
 
 static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
@@ -1290,7 +1514,7 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
 
 	obj = yaffs_inode_to_obj(inode);
 	dev = obj->my_dev;
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_writepage at %08x, size %08x",
@@ -1308,7 +1532,7 @@ static int yaffs_writepage(struct page *page, struct writeback_control *wbc)
 		"writepag1: obj = %05x, ino = %05x",
 		(int)obj->variant.file_variant.file_size, (int)inode->i_size);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	kunmap(page);
 	set_page_writeback(page);
@@ -1337,11 +1561,13 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
+	yaffs_cache_lock(dev);
 
 	n_free_chunks = yaffs_get_n_free_chunks(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_cache_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 
 	return (n_free_chunks > 20) ? 1 : 0;
 }
@@ -1355,9 +1581,9 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 }
 
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1427,7 +1653,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	inode = f->f_dentry->d_inode;
 
@@ -1465,7 +1691,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	return (n_written == 0) && (n > 0) ? -ENOSPC : n_written;
 }
 
@@ -1508,7 +1734,8 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock_shared(dev);
+	yaffs_cache_lock(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1560,7 +1787,8 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_cache_unlock(dev);
+	yaffs_meta_unlock_shared(dev);
 	return 0;
 }
 
@@ -1629,7 +1857,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		request_checkpoint ? "checkpoint requested" : "no checkpoint",
 		oneshot_checkpoint ? " one-shot" : "");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 	do_checkpoint = ((request_checkpoint && !gc_urgent) ||
 			 oneshot_checkpoint) && !dev->is_checkpointed;
 
@@ -1639,7 +1867,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 		if (oneshot_checkpoint)
 			yaffs_auto_checkpoint &= ~4;
 	}
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	return 0;
 }
@@ -1656,6 +1884,35 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
  * The thread should not do any writing while the fs is in read only.
  */
 
+/*
+ * Idle checkpointing.
+ * A checkpoint is only good until the next write and normally only gets
+ * written by sync and unmount, so an unclean shutdown usually means a full
+ * scan at the next mount. To make that rarer, the background thread
+ * writes a checkpoint once the flash has been left alone for
+ * yaffs_bg_checkpoint seconds (0 turns this off).
+ */
+static void yaffs_bg_checkpt(struct yaffs_dev *dev)
+{
+	struct super_block *sb = yaffs_dev_to_lc(dev)->super;
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+
+	yaffs_meta_lock(dev);
+	if (!dev->is_checkpointed && !yaffs_bg_gc_urgency(dev)) {
+		yaffs_update_dirty_dirs(dev);
+		yaffs_flush_whole_cache(dev);
+		yaffs_checkpoint_save(dev);
+		if (dev->is_checkpointed)
+			dev->n_bg_checkpts++;
+		yaffs_trace(YAFFS_TRACE_BACKGROUND | YAFFS_TRACE_CHECKPOINT,
+			"yaffs_background: idle checkpoint %s",
+			dev->is_checkpointed ? "written" : "failed");
+	}
+	yaffs_meta_unlock(dev);
+}
+
 void yaffs_background_waker(unsigned long data)
 {
 	wake_up_process((struct task_struct *)data);
@@ -1668,8 +1925,11 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long idle_since = now;
 	unsigned long expires;
 	unsigned int urgency;
+	u32 activity;
+	u32 last_activity = dev->n_page_writes + dev->n_erasures;
 
 	int gc_result;
 	struct timer_list timer;
@@ -1687,16 +1947,21 @@ static int yaffs_bg_thread_fn(void *data)
 		if (try_to_freeze())
 			continue;
 
-		yaffs_gross_lock(dev);
-
 		now = jiffies;
 
+		/*
+		 * Directory updates and gc take the lock separately so
+		 * readers get a look in between the two.
+		 */
 		if (time_after(now, next_dir_update) && yaffs_bg_enable) {
+			yaffs_meta_lock(dev);
 			yaffs_update_dirty_dirs(dev);
+			yaffs_meta_unlock(dev);
 			next_dir_update = now + HZ;
 		}
 
 		if (time_after(now, next_gc) && yaffs_bg_enable) {
+			yaffs_meta_lock(dev);
 			if (!dev->is_checkpointed) {
 				urgency = yaffs_bg_gc_urgency(dev);
 				gc_result = yaffs_bg_gc(dev, urgency);
@@ -1713,8 +1978,21 @@ static int yaffs_bg_thread_fn(void *data)
 				 */
 				next_gc = next_dir_update;
                         }
+			yaffs_meta_unlock(dev);
 		}
-		yaffs_gross_unlock(dev);
+
+		activity = dev->n_page_writes + dev->n_erasures;
+		if (activity != last_activity || dev->is_checkpointed) {
+			last_activity = activity;
+			idle_since = now;
+		} else if (yaffs_bg_checkpoint && yaffs_auto_checkpoint &&
+			   yaffs_bg_enable &&
+			   time_after(now, idle_since + yaffs_bg_checkpoint * HZ)) {
+			yaffs_bg_checkpt(dev);
+			last_activity = dev->n_page_writes + dev->n_erasures;
+			idle_since = jiffies;
+		}
+
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
 			expires = next_gc;
@@ -1804,6 +2082,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;		/* 0 for the default */
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -1859,6 +2138,11 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache-entries=", 14)) {
+			options->n_caches =
+			    simple_strtoul(cur_opt + 14, NULL, 10);
+			if (options->n_caches < 1)
+				error = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -1878,6 +2162,7 @@ static int yaffs_parse_options(struct yaffs_options *options,
 
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
+	.readpages = yaffs_readpages,
 	.writepage = yaffs_writepage,
 	.write_begin = yaffs_write_begin,
 	.write_end = yaffs_write_end,
@@ -2012,7 +2297,7 @@ static void yaffs_put_super(struct super_block *sb)
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_BACKGROUND,
 		"yaffs background thread shut down");
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	yaffs_flush_super(sb, 1);
 
@@ -2021,7 +2306,7 @@ static void yaffs_put_super(struct super_block *sb)
 
 	yaffs_deinitialise(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 	mutex_lock(&yaffs_context_lock);
 	list_del_init(&(yaffs_dev_to_lc(dev)->context_list));
 	mutex_unlock(&yaffs_context_lock);
@@ -2030,6 +2315,7 @@ static void yaffs_put_super(struct super_block *sb)
 		kfree(yaffs_dev_to_lc(dev)->spare_buffer);
 		yaffs_dev_to_lc(dev)->spare_buffer = NULL;
 	}
+	kfree(yaffs_dev_to_lc(dev)->multi_oob);
 
 	kfree(dev);
 }
@@ -2261,7 +2547,12 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		param->n_caches = 0;
+	else if (options.n_caches)
+		param->n_caches = options.n_caches;
+	else
+		param->n_caches = 10;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2308,6 +2599,17 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
+		param->read_block_tags_fn = nandmtd2_read_block_tags;
+		if (yaffs_multi_chunk) {
+			param->read_chunks_fn = nandmtd2_read_chunks;
+			yaffs_dev_to_lc(dev)->multi_oob =
+			    kmalloc(YAFFS_MAX_MULTI_CHUNKS * mtd->oobavail,
+				    GFP_NOFS);
+			if (yaffs_dev_to_lc(dev)->multi_oob)
+				param->write_chunks_fn = nandmtd2_write_chunks;
+		}
+		/* bit 0: cost-benefit victims */
+		param->gc_cost_benefit = (yaffs_gc_policy & 1) ? 1 : 0;
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
 		param->is_yaffs2 = 1;
@@ -2366,9 +2668,11 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->meta_lock));
+	mutex_init(&(yaffs_dev_to_lc(dev)->cache_lock));
+	spin_lock_init(&(yaffs_dev_to_lc(dev)->lock_stats_lock));
 
-	yaffs_gross_lock(dev);
+	yaffs_meta_lock(dev);
 
 	err = yaffs_guts_initialise(dev);
 
@@ -2383,7 +2687,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->defered_dir_update = 0;
 
 	/* Release lock before yaffs_get_inode() */
-	yaffs_gross_unlock(dev);
+	yaffs_meta_unlock(dev);
 
 	/* Create root inode */
 	if (err == YAFFS_OK)
@@ -2491,6 +2795,33 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 	return buf;
 }
 
+static char *yaffs_dump_lock(char *buf, const char *name,
+			     const struct yaffs_lock_stats *stats)
+{
+	buf += sprintf(buf, "%s acquired %u contended %u wait_ns %llu max_wait_ns %llu\n",
+		       name, stats->acquired, stats->contended,
+		       stats->wait_ns, stats->max_wait_ns);
+	return buf;
+}
+
+static char *yaffs_dump_lock_stats(char *buf, struct yaffs_dev *dev)
+{
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(dev);
+	struct yaffs_lock_stats excl, shared, cache;
+
+	spin_lock(&lc->lock_stats_lock);
+	excl = lc->meta_excl_stats;
+	shared = lc->meta_shared_stats;
+	cache = lc->cache_stats;
+	spin_unlock(&lc->lock_stats_lock);
+
+	buf = yaffs_dump_lock(buf, "meta_lock (excl)..", &excl);
+	buf = yaffs_dump_lock(buf, "meta_lock (shared)", &shared);
+	buf = yaffs_dump_lock(buf, "cache_lock........", &cache);
+
+	return buf;
+}
+
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
 	buf +=
@@ -2511,6 +2842,19 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_page_reads.......... %u\n", dev->n_page_reads);
 	buf += sprintf(buf, "n_erasures............ %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies........... %u\n", dev->n_gc_copies);
+	buf += sprintf(buf, "n_host_writes......... %u\n", dev->n_host_writes);
+	/* (host writes + gc copies) / host writes and copies per gc block */
+	buf +=
+	    sprintf(buf, "write_amp_x100........ %u\n",
+		    dev->n_host_writes ?
+		    (u32)div_u64(100ULL * (dev->n_host_writes +
+					   dev->n_gc_copies),
+				 dev->n_host_writes) : 100);
+	buf +=
+	    sprintf(buf, "gc_copies_per_blk_x100 %u\n",
+		    dev->n_gc_blocks ?
+		    (u32)div_u64(100ULL * dev->n_gc_copies,
+				 dev->n_gc_blocks) : 0);
 	buf += sprintf(buf, "all_gcs............... %u\n", dev->all_gcs);
 	buf +=
 	    sprintf(buf, "passive_gc_count...... %u\n", dev->passive_gc_count);
@@ -2531,12 +2875,42 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses.......... %u\n", dev->cache_misses);
+	buf +=
+	    sprintf(buf, "cache_evictions....... %u\n", dev->cache_evictions);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
 	    sprintf(buf, "n_unlinked_files...... %u\n", dev->n_unlinked_files);
 	buf += sprintf(buf, "refresh_count......... %u\n", dev->refresh_count);
 	buf += sprintf(buf, "n_bg_deletions........ %u\n", dev->n_bg_deletions);
+	buf += sprintf(buf, "n_bg_checkpts......... %u\n", dev->n_bg_checkpts);
+	buf += sprintf(buf, "\n");
+	buf += sprintf(buf, "mount_total_us........ %u\n", dev->mount_total_us);
+	buf +=
+	    sprintf(buf, "mount_checkpt_us...... %u\n", dev->mount_checkpt_us);
+	buf += sprintf(buf, "mount_query_us........ %u\n", dev->mount_query_us);
+	buf += sprintf(buf, "mount_sort_us......... %u\n", dev->mount_sort_us);
+	buf += sprintf(buf, "mount_scan_us......... %u\n", dev->mount_scan_us);
+	buf += sprintf(buf, "mount_fixup_us........ %u\n", dev->mount_fixup_us);
+	buf +=
+	    sprintf(buf, "n_scan_batched........ %u\n", dev->n_scan_batched);
+	buf +=
+	    sprintf(buf, "n_scan_unbatched...... %u\n", dev->n_scan_unbatched);
+	buf += sprintf(buf, "n_multi_reads......... %u\n", dev->n_multi_reads);
+	buf +=
+	    sprintf(buf, "n_multi_read_chunks... %u\n",
+		    dev->n_multi_read_chunks);
+	buf +=
+	    sprintf(buf, "n_multi_read_fails.... %u\n",
+		    dev->n_multi_read_fails);
+	buf +=
+	    sprintf(buf, "n_multi_writes........ %u\n", dev->n_multi_writes);
+	buf +=
+	    sprintf(buf, "n_multi_write_chunks.. %u\n",
+		    dev->n_multi_write_chunks);
+	buf += sprintf(buf, "\n");
+	buf = yaffs_dump_lock_stats(buf, dev);
 
 	return buf;
 }
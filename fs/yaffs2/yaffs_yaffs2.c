@@ -954,9 +954,48 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Tag prefetching for the backwards scan.
+ *
+ * The scan is a long run of small flash reads with a bit of processing
+ * between each. To keep the flash busy, a worker reads the tags of the
+ * next block to be scanned (in one driver request) while the current
+ * block is being processed. Two of these are used in turn.
+ */
+struct yaffs_scan_prefetch {
+	struct work_struct work;
+	struct yaffs_dev *dev;
+	int block;
+	int fetched;
+	struct yaffs_ext_tags *tags;
+};
+
+static void yaffs2_scan_prefetch_fn(struct work_struct *work)
+{
+	struct yaffs_scan_prefetch *pf =
+	    container_of(work, struct yaffs_scan_prefetch, work);
+
+	pf->fetched =
+	    (yaffs_fetch_block_tags(pf->dev, pf->block, pf->tags) == YAFFS_OK);
+}
+
+static void yaffs2_scan_prefetch(struct yaffs_scan_prefetch *pf, int block)
+{
+	pf->block = block;
+	pf->fetched = 0;
+	queue_work(system_unbound_wq, &pf->work);
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
+	struct yaffs_ext_tags *block_tags;
+	struct yaffs_scan_prefetch prefetch[2];
+	int use_prefetch;
+	int cur = 0;
+	int fetched;
+	u64 t_start;
+	u64 t_now;
 	int blk;
 	int block_iter;
 	int start_iter;
@@ -1009,10 +1048,33 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	block_tags = kmalloc(2 * dev->param.chunks_per_block *
+			     sizeof(struct yaffs_ext_tags), GFP_NOFS);
+	if (!block_tags) {
+		yaffs_trace(YAFFS_TRACE_SCAN,
+			"yaffs2_scan_backwards() could not allocate tags buffer!"
+			);
+		if (alt_block_index)
+			vfree(block_index);
+		else
+			kfree(block_index);
+		return YAFFS_FAIL;
+	}
+
+	use_prefetch = dev->param.read_block_tags_fn && !dev->param.inband_tags;
+	for (c = 0; c < 2; c++) {
+		INIT_WORK_ONSTACK(&prefetch[c].work, yaffs2_scan_prefetch_fn);
+		prefetch[c].dev = dev;
+		prefetch[c].fetched = 0;
+		prefetch[c].tags = block_tags + c * dev->param.chunks_per_block;
+	}
+
 	dev->blocks_in_checkpt = 0;
 
 	chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
+	t_start = Y_CLOCK_US();
+
 	/* Scan all the blocks to determine their state */
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
@@ -1069,6 +1131,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 		bi++;
 	}
 
+	t_now = Y_CLOCK_US();
+	dev->mount_query_us = t_now - t_start;
+	t_start = t_now;
+
 	yaffs_trace(YAFFS_TRACE_SCAN, "%d blocks to be sorted...", n_to_scan);
 
 	cond_resched();
@@ -1079,6 +1145,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	cond_resched();
 
+	t_now = Y_CLOCK_US();
+	dev->mount_sort_us = t_now - t_start;
+	t_start = t_now;
+
 	yaffs_trace(YAFFS_TRACE_SCAN, "...done");
 
 	/* Now scan the blocks looking at the data. */
@@ -1086,6 +1156,10 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	if (use_prefetch && n_to_scan > 0)
+		yaffs2_scan_prefetch(&prefetch[cur],
+				     block_index[end_iter].block);
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1102,6 +1176,18 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		/* Pick up this block's tags and start on the next block's */
+		fetched = 0;
+		if (use_prefetch) {
+			flush_work(&prefetch[cur].work);
+			fetched = prefetch[cur].fetched;
+			if (block_iter > start_iter)
+				yaffs2_scan_prefetch(&prefetch[!cur],
+					block_index[block_iter - 1].block);
+		}
+		yaffs_rd_block_tags_nand(dev, blk, prefetch[cur].tags,
+					 fetched);
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1200,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			tags = prefetch[cur].tags[c];
 
 			/* Let's have a good look at this chunk... */
 
@@ -1571,8 +1656,20 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			yaffs_block_became_dirty(dev, blk);
 		}
 
+		cur = !cur;
 	}
 
+	/* Out of memory can leave the next block's prefetch in flight */
+	for (c = 0; c < 2; c++) {
+		flush_work(&prefetch[c].work);
+		destroy_work_on_stack(&prefetch[c].work);
+	}
+	kfree(block_tags);
+
+	t_now = Y_CLOCK_US();
+	dev->mount_scan_us = t_now - t_start;
+	t_start = t_now;
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
@@ -1587,6 +1684,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	 */
 	yaffs_link_fixup(dev, hard_list);
 
+	dev->mount_fixup_us = Y_CLOCK_US() - t_start;
+
 	yaffs_release_temp_buffer(dev, chunk_data, __LINE__);
 
 	if (alloc_failed)
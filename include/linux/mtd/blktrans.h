@@ -59,6 +59,9 @@ struct mtd_blktrans_ops {
 	/* Access functions */
 	int (*readsect)(struct mtd_blktrans_dev *dev,
 		    unsigned long block, char *buffer);
+	/* Optional, reads nsect blocks with one call so they can be streamed */
+	int (*readsects)(struct mtd_blktrans_dev *dev,
+		     unsigned long block, unsigned nsect, char *buffer);
 	int (*writesect)(struct mtd_blktrans_dev *dev,
 		     unsigned long block, char *buffer);
 	int (*discard)(struct mtd_blktrans_dev *dev,
@@ -71,6 +71,38 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
 /* sysctls */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_index_add(struct task_struct *p);
+extern void lowmem_adj_index_del(struct task_struct *p);
+extern void lowmem_adj_index_replace(struct task_struct *old,
+				     struct task_struct *new);
+extern void lowmem_adj_index_update(struct task_struct *p);
+extern void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+			      unsigned long reclaimed);
+extern void lowmem_vmpressure_prio(gfp_t gfp, int priority);
+#else
+static inline void lowmem_adj_index_add(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_index_del(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_index_replace(struct task_struct *old,
+					    struct task_struct *new)
+{
+}
+static inline void lowmem_adj_index_update(struct task_struct *p)
+{
+}
+static inline void lowmem_vmpressure(gfp_t gfp, unsigned long scanned,
+				     unsigned long reclaimed)
+{
+}
+static inline void lowmem_vmpressure_prio(gfp_t gfp, int priority)
+{
+}
+#endif
+
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
 extern int sysctl_panic_on_oom;
@@ -1283,6 +1283,11 @@ struct task_struct {
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* thread group leaders, filed by oom_adj for the lowmemorykiller */
+	struct list_head lowmem_adj_node;
+	int lowmem_adj_idx;
+#endif
 
 	struct mm_struct *mm, *active_mm;
 #ifdef CONFIG_COMPAT_BRK
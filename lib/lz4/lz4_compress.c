@@ -0,0 +1,129 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Single pass, hash-chain-less LZ77 matcher producing the LZ4 block
+ *  format. Trades some compression ratio against LZO for a simpler
+ *  stream that decodes with little more than memcpy().
+ *
+ *  LZ4 format: Copyright (C) 2011-2012, Yann Collet.
+ *  BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+
+	return op;
+}
+
+static inline unsigned char *lz4_put_literals(unsigned char *op,
+		const unsigned char *anchor, size_t lit_len, size_t match_len)
+{
+	unsigned char *token = op++;
+
+	if (lit_len >= RUN_MASK) {
+		*token = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, lit_len - RUN_MASK);
+	} else {
+		*token = lit_len << ML_BITS;
+	}
+
+	if (match_len >= ML_MASK)
+		*token |= ML_MASK;
+	else
+		*token |= match_len;
+
+	memcpy(op, anchor, lit_len);
+
+	return op + lit_len;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ip = src, *anchor = src, *ref;
+	unsigned char *op = dst;
+	u32 *table = wrkmem;
+	size_t match_len;
+	u32 seq;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+	table[LZ4_HASH(get_unaligned((const u32 *)ip))] = 0;
+	ip++;
+
+	while (ip <= mflimit) {
+		unsigned int attempts = 1 << SKIP_STRENGTH;
+
+		/* Find a 4 byte match */
+		for (;;) {
+			u32 h;
+
+			seq = get_unaligned((const u32 *)ip);
+			h = LZ4_HASH(seq);
+			ref = src + table[h];
+			table[h] = ip - src;
+
+			if (ref < ip && ip - ref <= MAX_DISTANCE &&
+			    get_unaligned((const u32 *)ref) == seq)
+				break;
+
+			ip += attempts++ >> SKIP_STRENGTH;
+			if (ip > mflimit)
+				goto last_literals;
+		}
+
+		/* Catch up with identical bytes preceding the match */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Extend the match forwards */
+		match_len = MINMATCH;
+		while (ip + match_len < matchlimit &&
+		       ip[match_len] == ref[match_len])
+			match_len++;
+
+		op = lz4_put_literals(op, anchor, ip - anchor,
+				match_len - MINMATCH);
+		put_unaligned_le16((u16)(ip - ref), op);
+		op += 2;
+		if (match_len - MINMATCH >= ML_MASK)
+			op = lz4_put_length(op, match_len - MINMATCH - ML_MASK);
+
+		ip += match_len;
+		anchor = ip;
+
+		/* Prime the table with a position inside the match */
+		if (ip <= mflimit)
+			table[LZ4_HASH(get_unaligned((const u32 *)(ip - 2)))] =
+				ip - 2 - src;
+	}
+
+last_literals:
+	op = lz4_put_literals(op, anchor, iend - anchor, 0);
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
@@ -0,0 +1,122 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Every length and offset read from the stream is checked against both
+ *  the input and the output buffer, so corrupted or hostile input can
+ *  not make it read or write out of bounds.
+ *
+ *  LZ4 format: Copyright (C) 2011-2012, Yann Collet.
+ *  BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+ */
+
+#ifndef STATIC
+#include <linux/module.h>
+#include <linux/kernel.h>
+#endif
+
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char * const iend = src + src_len;
+	unsigned char * const oend = dst + *dst_len;
+	const unsigned char *ip = src;
+	unsigned char *op = dst;
+	const unsigned char *ref;
+	size_t len, offset;
+	unsigned int token, s;
+
+	*dst_len = 0;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* Literal run */
+		len = token >> ML_BITS;
+		if (len == RUN_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto input_overrun;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+
+		if (unlikely(len > (size_t)(iend - ip)))
+			goto input_overrun;
+		if (unlikely(len > (size_t)(oend - op)))
+			goto output_overrun;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		/* The final sequence carries literals only */
+		if (ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			goto input_overrun;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+
+		if (unlikely(!offset || offset > (size_t)(op - dst)))
+			goto lookbehind_overrun;
+		ref = op - offset;
+
+		/* Match */
+		len = token & ML_MASK;
+		if (len == ML_MASK) {
+			do {
+				if (unlikely(ip >= iend))
+					goto input_overrun;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+		}
+		len += MINMATCH;
+
+		if (unlikely(len > (size_t)(oend - op)))
+			goto output_overrun;
+
+		/*
+		 * A match may overlap its own output (runs). Copying it in
+		 * chunks of at most 'offset' bytes keeps every memcpy()
+		 * non-overlapping.
+		 */
+		while (len) {
+			size_t n = min(len, offset);
+
+			memcpy(op, ref, n);
+			op += n;
+			ref += n;
+			len -= n;
+		}
+	}
+
+	*dst_len = op - dst;
+	return LZ4_E_OK;
+
+input_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_INPUT_OVERRUN;
+
+output_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+	*dst_len = op - dst;
+	return LZ4_E_LOOKBEHIND_OVERRUN;
+}
+#ifndef STATIC
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
+
+#endif
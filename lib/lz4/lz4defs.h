@@ -0,0 +1,25 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants
+ *
+ *  LZ4 format: Copyright (C) 2011-2012, Yann Collet.
+ *  BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+ */
+
+#define MINMATCH	4
+
+/* the last match must start at least MFLIMIT bytes before the end */
+#define MFLIMIT		12
+/* and the last LASTLITERALS bytes are always encoded as literals */
+#define LASTLITERALS	5
+
+#define MAX_DISTANCE	0xffff
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+/* search gets faster the longer it goes without finding a match */
+#define SKIP_STRENGTH	6
+
+#define LZ4_HASH(v)	(((v) * 2654435761U) >> (32 - LZ4_HASH_LOG))
@@ -27,6 +27,9 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,7 +40,7 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
@@ -46,12 +49,15 @@ struct ashmem_area {
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects all of the above */
+	u64 locked_at;			/* when `mutex' was taken */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's mutex, and the `lru' entry also by
+ * ashmem_lru_lock
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
@@ -62,18 +68,32 @@ struct ashmem_range {
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list of unpinned ranges
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock, and
+ *		  asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker goes the other way only with mutex_trylock().
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* the shrinker gives up after finding this many areas busy in a row */
+#define ASHMEM_SHRINK_BUSY_MAX	16
+
+/* statistics, see ashmem_get_stats() */
+static atomic64_t ashmem_purged_bytes = ATOMIC64_INIT(0);
+static atomic64_t ashmem_purged_ranges = ATOMIC64_INIT(0);
+static atomic64_t ashmem_purge_truncates = ATOMIC64_INIT(0);
+static atomic64_t ashmem_lock_wait_ns = ATOMIC64_INIT(0);
+static atomic64_t ashmem_lock_hold_ns = ATOMIC64_INIT(0);
+static atomic64_t ashmem_shrink_busy = ATOMIC64_INIT(0);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -102,18 +122,51 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+static inline void asma_lock(struct ashmem_area *asma)
+{
+	u64 start = local_clock();
+
+	mutex_lock(&asma->mutex);
+	asma->locked_at = local_clock();
+	atomic64_add(asma->locked_at - start, &ashmem_lock_wait_ns);
+}
+
+static inline int asma_trylock(struct ashmem_area *asma)
+{
+	if (!mutex_trylock(&asma->mutex))
+		return 0;
+	asma->locked_at = local_clock();
+	return 1;
+}
+
+static inline void asma_unlock(struct ashmem_area *asma)
+{
+	atomic64_add(local_clock() - asma->locked_at, &ashmem_lock_hold_ns);
+	mutex_unlock(&asma->mutex);
+}
+
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock. */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
@@ -123,7 +176,7 @@ static inline void lru_del(struct ashmem_range *range)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int range_alloc(struct ashmem_area *asma,
 		       struct ashmem_range *prev_range, unsigned int purged,
@@ -159,7 +212,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +222,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -187,6 +243,7 @@ static int ashmem_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 
 	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,10 +256,10 @@ static int ashmem_release(struct inode *ignored, struct file *file)
 	struct ashmem_area *asma = file->private_data;
 	struct ashmem_range *range, *next;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
 		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +274,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +295,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -247,7 +304,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +325,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -285,7 +342,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,10 +385,65 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
+/*
+ * ashmem_purge - purges 'range', together with the ranges of its area right
+ * next to it, with a single truncate. Returns the number of pages that were
+ * on the LRU list.
+ *
+ * Caller must hold asma->mutex.
+ */
+static size_t ashmem_purge(struct ashmem_range *range)
+{
+	struct ashmem_area *asma = range->asma;
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_range *lo = range, *hi = range, *r;
+	unsigned long nr_ranges = 0;
+	size_t nr_pages = 0;
+
+	/* the unpinned list is sorted by descending page, extend both ways */
+	while (lo->unpinned.next != &asma->unpinned_list) {
+		r = list_entry(lo->unpinned.next, struct ashmem_range,
+			       unpinned);
+		if (r->pgend + 1 != lo->pgstart)
+			break;
+		lo = r;
+	}
+	while (hi->unpinned.prev != &asma->unpinned_list) {
+		r = list_entry(hi->unpinned.prev, struct ashmem_range,
+			       unpinned);
+		if (hi->pgend + 1 != r->pgstart)
+			break;
+		hi = r;
+	}
+
+	vmtruncate_range(inode, lo->pgstart * PAGE_SIZE,
+			 (hi->pgend + 1) * PAGE_SIZE - 1);
+
+	r = hi;
+	spin_lock(&ashmem_lru_lock);
+	list_for_each_entry_from(r, &asma->unpinned_list, unpinned) {
+		if (range_on_lru(r)) {
+			__lru_del(r);
+			r->purged = ASHMEM_WAS_PURGED;
+			nr_pages += range_size(r);
+			nr_ranges++;
+		}
+		if (r == lo)
+			break;
+	}
+	spin_unlock(&ashmem_lru_lock);
+
+	atomic64_inc(&ashmem_purge_truncates);
+	atomic64_add(nr_ranges, &ashmem_purged_ranges);
+	atomic64_add(nr_pages * PAGE_SIZE, &ashmem_purged_bytes);
+
+	return nr_pages;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -344,12 +456,17 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ * Each one goes together with the unpinned ranges of its area next to it,
+ * in one truncate. Areas that are busy pinning and unpinning are skipped,
+ * rather than waited for.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	unsigned long freed = 0;
+	int busy = 0;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
@@ -357,21 +474,33 @@ static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	if (!sc->nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	spin_lock(&ashmem_lru_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&ashmem_lru_list)) {
+		range = list_first_entry(&ashmem_lru_list, struct ashmem_range,
+					 lru);
+		asma = range->asma;
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+		/*
+		 * While the range is on the LRU list, its area cannot have
+		 * been released, so it is safe to try its mutex.
+		 */
+		if (!asma_trylock(asma)) {
+			atomic64_inc(&ashmem_shrink_busy);
+			if (++busy > ASHMEM_SHRINK_BUSY_MAX)
+				break;
+			list_move_tail(&range->lru, &ashmem_lru_list);
+			continue;
+		}
+		spin_unlock(&ashmem_lru_lock);
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
+		/* A purge can take more than we asked for */
+		freed += ashmem_purge(range);
+		asma_unlock(asma);
+		busy = 0;
+
+		spin_lock(&ashmem_lru_lock);
 	}
-	mutex_unlock(&ashmem_mutex);
+	spin_unlock(&ashmem_lru_lock);
 
 	return lru_count;
 }
@@ -381,11 +510,30 @@ static struct shrinker ashmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 4,
 };
 
+static int ashmem_get_stats(char *buffer, const struct kernel_param *kp)
+{
+	return scnprintf(buffer, PAGE_SIZE,
+		"unpinned: %lu pages\n"
+		"purged: %lld bytes in %lld ranges, %lld truncates\n"
+		"area lock: wait %lld us, held %lld us\n"
+		"shrinker skipped busy areas: %lld\n",
+		lru_count,
+		(long long) atomic64_read(&ashmem_purged_bytes),
+		(long long) atomic64_read(&ashmem_purged_ranges),
+		(long long) atomic64_read(&ashmem_purge_truncates),
+		(long long) div_u64(atomic64_read(&ashmem_lock_wait_ns),
+				    NSEC_PER_USEC),
+		(long long) div_u64(atomic64_read(&ashmem_lock_hold_ns),
+				    NSEC_PER_USEC),
+		(long long) atomic64_read(&ashmem_shrink_busy));
+}
+module_param_call(stats, NULL, ashmem_get_stats, NULL, S_IRUGO);
+
 static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +548,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 	return ret;
 }
 
@@ -408,7 +556,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +570,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 
 	return ret;
 }
@@ -431,7 +579,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +596,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 
 	return ret;
 }
@@ -457,7 +605,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -523,7 +671,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
@@ -558,7 +706,7 @@ restart:
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
@@ -607,7 +755,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	asma_lock(asma);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,7 +769,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	asma_unlock(asma);
 
 	return ret;
 }
@@ -0,0 +1,397 @@
+/*
+ * binder_bench: measure binder round trip latency and throughput
+ *
+ * A server process becomes the context manager and echoes every
+ * transaction back as its reply. The client sends synchronous
+ * transactions to handle 0 for each combination of payload size and
+ * binder object count, and reports calls per second and the p50/p99
+ * round trip time.
+ *
+ * Becoming the context manager fails while another one (servicemanager
+ * on a running Android system) is registered, so run it with that
+ * stopped or on a test system.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Compile by:
+ *
+ * $(CROSS_COMPILE)gcc -Wall -O2 -o binder_bench binder_bench.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../../drivers/staging/android/binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	((1 * 1024 * 1024) - (4096 * 2))
+
+#define BENCH_PING	1
+#define BENCH_QUIT	2
+
+#define MAX_OBJECTS	64
+#define WARMUP		100
+
+static const size_t default_sizes[] = { 16, 256, 1024, 4096, 16384 };
+static const int default_objects[] = { 0, 1, 8 };
+
+struct bench_conn {
+	int fd;
+	void *map;
+	unsigned char wbuf[512] __attribute__((aligned(8)));
+	size_t wlen;
+	unsigned char rbuf[512] __attribute__((aligned(8)));
+};
+
+/* objects the client hands out, their addresses are the binder ptrs */
+static char local_objects[MAX_OBJECTS];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void put_data(struct bench_conn *c, const void *data, size_t len)
+{
+	if (len > sizeof(c->wbuf) - c->wlen) {
+		fprintf(stderr, "binder_bench: command buffer overflow "
+			"(%zu + %zu > %zu bytes)\n",
+			c->wlen, len, sizeof(c->wbuf));
+		exit(1);
+	}
+	memcpy(c->wbuf + c->wlen, data, len);
+	c->wlen += len;
+}
+
+static void put_u32(struct bench_conn *c, uint32_t v)
+{
+	put_data(c, &v, sizeof(v));
+}
+
+static int bench_open(struct bench_conn *c)
+{
+	struct binder_version version;
+
+	c->wlen = 0;
+	c->fd = open(BINDER_DEV, O_RDWR);
+	if (c->fd < 0)
+		return -1;
+	if (ioctl(c->fd, BINDER_VERSION, &version) < 0)
+		return -1;
+	if (version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		errno = EPROTO;
+		return -1;
+	}
+	c->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, c->fd, 0);
+	if (c->map == MAP_FAILED)
+		return -1;
+	return 0;
+}
+
+/*
+ * Flush the pending commands and, if asked to, wait for and read
+ * whatever the driver returns.
+ */
+static size_t bench_io(struct bench_conn *c, int do_read)
+{
+	struct binder_write_read bwr;
+
+	bwr.write_size = c->wlen;
+	bwr.write_consumed = 0;
+	bwr.write_buffer = (unsigned long)c->wbuf;
+	bwr.read_size = do_read ? sizeof(c->rbuf) : 0;
+	bwr.read_consumed = 0;
+	bwr.read_buffer = (unsigned long)c->rbuf;
+	do {
+		if (ioctl(c->fd, BINDER_WRITE_READ, &bwr) >= 0)
+			break;
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+	} while (1);
+	if ((size_t)bwr.write_consumed != c->wlen) {
+		fprintf(stderr, "binder_bench: short write %ld of %zd\n",
+			bwr.write_consumed, c->wlen);
+		exit(1);
+	}
+	c->wlen = 0;
+	return bwr.read_consumed;
+}
+
+/*
+ * Handle the bookkeeping returns both sides can see. Returns the
+ * transaction data for BR_TRANSACTION and BR_REPLY, NULL otherwise.
+ */
+static struct binder_transaction_data *
+bench_parse(struct bench_conn *c, size_t *pos, size_t len, uint32_t *cmdp)
+{
+	struct binder_transaction_data *tr = NULL;
+	struct binder_ptr_cookie *pc;
+	uint32_t cmd;
+
+	memcpy(&cmd, c->rbuf + *pos, sizeof(cmd));
+	*pos += sizeof(cmd);
+	*cmdp = cmd;
+
+	switch (cmd) {
+	case BR_TRANSACTION:
+	case BR_REPLY:
+		tr = (void *)(c->rbuf + *pos);
+		break;
+	case BR_INCREFS:
+	case BR_ACQUIRE:
+		pc = (void *)(c->rbuf + *pos);
+		put_u32(c, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+			BC_ACQUIRE_DONE);
+		put_data(c, pc, sizeof(*pc));
+		break;
+	case BR_DEAD_REPLY:
+	case BR_FAILED_REPLY:
+		fprintf(stderr, "binder_bench: transaction failed (%s)\n",
+			cmd == BR_DEAD_REPLY ? "dead reply" : "failed reply");
+		exit(1);
+	case BR_ERROR:
+		fprintf(stderr, "binder_bench: BR_ERROR\n");
+		exit(1);
+	default:
+		break;
+	}
+	*pos += _IOC_SIZE(cmd);
+	if (*pos > len) {
+		fprintf(stderr, "binder_bench: truncated return %x\n", cmd);
+		exit(1);
+	}
+	return tr;
+}
+
+static void server_loop(struct bench_conn *c)
+{
+	struct binder_transaction_data *tr, reply;
+	size_t pos, len;
+	uint32_t cmd;
+	int quit = 0;
+
+	put_u32(c, BC_ENTER_LOOPER);
+	while (!quit) {
+		len = bench_io(c, 1);
+		for (pos = 0; pos < len; ) {
+			tr = bench_parse(c, &pos, len, &cmd);
+			if (cmd != BR_TRANSACTION)
+				continue;
+
+			/* echo the data back, the objects become plain bytes */
+			memset(&reply, 0, sizeof(reply));
+			reply.data_size = tr->data_size;
+			reply.data.ptr.buffer = tr->data.ptr.buffer;
+			put_u32(c, BC_REPLY);
+			put_data(c, &reply, sizeof(reply));
+			put_u32(c, BC_FREE_BUFFER);
+			put_data(c, &tr->data.ptr.buffer, sizeof(void *));
+			if (tr->code == BENCH_QUIT)
+				quit = 1;
+		}
+	}
+	bench_io(c, 0);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* one synchronous call to the server, returns its round trip in ns */
+static uint64_t client_call(struct bench_conn *c, uint32_t code,
+			    const void *data, size_t data_size,
+			    const size_t *offsets, size_t offsets_size)
+{
+	struct binder_transaction_data tr, *rtr;
+	uint64_t start;
+	size_t pos, len;
+	uint32_t cmd;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = 0;
+	tr.code = code;
+	tr.data_size = data_size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	put_u32(c, BC_TRANSACTION);
+	put_data(c, &tr, sizeof(tr));
+
+	start = now_ns();
+	for (;;) {
+		len = bench_io(c, 1);
+		for (pos = 0; pos < len; ) {
+			rtr = bench_parse(c, &pos, len, &cmd);
+			if (cmd != BR_REPLY)
+				continue;
+			start = now_ns() - start;
+			/* freed with the next call */
+			put_u32(c, BC_FREE_BUFFER);
+			put_data(c, &rtr->data.ptr.buffer, sizeof(void *));
+			return start;
+		}
+	}
+}
+
+static void run_case(struct bench_conn *c, int iterations, size_t size,
+		     int objects)
+{
+	struct flat_binder_object *obj;
+	size_t offsets[MAX_OBJECTS];
+	size_t data_size = size;
+	uint64_t *samples, total = 0;
+	unsigned char *data;
+	int i;
+
+	if (data_size < objects * sizeof(*obj))
+		data_size = objects * sizeof(*obj);
+	data = calloc(1, data_size);
+	samples = calloc(iterations, sizeof(*samples));
+	if (!data || !samples)
+		die("calloc");
+
+	for (i = 0; i < objects; i++) {
+		obj = (void *)(data + i * sizeof(*obj));
+		obj->type = BINDER_TYPE_BINDER;
+		obj->flags = 0x7f;
+		obj->binder = &local_objects[i];
+		obj->cookie = &local_objects[i];
+		offsets[i] = i * sizeof(*obj);
+	}
+
+	for (i = 0; i < WARMUP; i++)
+		client_call(c, BENCH_PING, data, data_size, offsets,
+			    objects * sizeof(size_t));
+	for (i = 0; i < iterations; i++) {
+		samples[i] = client_call(c, BENCH_PING, data, data_size,
+					 offsets, objects * sizeof(size_t));
+		total += samples[i];
+	}
+
+	qsort(samples, iterations, sizeof(*samples), cmp_u64);
+	printf("%8zd %7d %10.0f %10.1f %10.1f %10.1f\n",
+	       data_size, objects,
+	       total ? iterations * 1e9 / total : 0.0,
+	       total / 1e3 / iterations,
+	       samples[iterations * 50 / 100] / 1e3,
+	       samples[iterations * 99 / 100] / 1e3);
+
+	free(samples);
+	free(data);
+}
+
+static void usage(void)
+{
+	printf("binder_bench [-i iterations] [-s size] [-o objects]\n"
+	       "  -i n  calls per measurement (default 10000)\n"
+	       "  -s n  only test a payload of n bytes\n"
+	       "  -o n  only test n binder objects per call (max %d)\n",
+	       MAX_OBJECTS);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t *sizes = default_sizes;
+	const int *objects = default_objects;
+	int nr_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+	int nr_objects = sizeof(default_objects) / sizeof(default_objects[0]);
+	size_t size_arg;
+	int objects_arg;
+	int iterations = 10000;
+	struct bench_conn c;
+	int ready[2];
+	pid_t server;
+	int status;
+	int err;
+	int i, j;
+
+	while ((i = getopt(argc, argv, "i:s:o:h")) != -1) {
+		switch (i) {
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			size_arg = strtoul(optarg, NULL, 0);
+			sizes = &size_arg;
+			nr_sizes = 1;
+			break;
+		case 'o':
+			objects_arg = atoi(optarg);
+			objects = &objects_arg;
+			nr_objects = 1;
+			break;
+		default:
+			usage();
+			return i == 'h' ? 0 : 1;
+		}
+	}
+	if (iterations < 1 || objects[0] < 0 || objects[0] > MAX_OBJECTS) {
+		usage();
+		return 1;
+	}
+
+	if (pipe(ready))
+		die("pipe");
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(ready[0]);
+		err = 0;
+		if (bench_open(&c) ||
+		    ioctl(c.fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+			err = errno;
+		if (write(ready[1], &err, sizeof(err)) != sizeof(err) || err)
+			_exit(1);
+		close(ready[1]);
+		server_loop(&c);
+		_exit(0);
+	}
+
+	close(ready[1]);
+	if (read(ready[0], &err, sizeof(err)) != sizeof(err))
+		err = EIO;
+	if (err) {
+		errno = err;
+		die("binder_bench: server setup");
+	}
+	if (bench_open(&c))
+		die(BINDER_DEV);
+
+	printf("%8s %7s %10s %10s %10s %10s\n", "bytes", "objects",
+	       "calls/s", "avg us", "p50 us", "p99 us");
+	for (i = 0; i < nr_sizes; i++)
+		for (j = 0; j < nr_objects; j++)
+			run_case(&c, iterations, sizes[i], objects[j]);
+
+	client_call(&c, BENCH_QUIT, NULL, 0, NULL, 0);
+	bench_io(&c, 0);
+	waitpid(server, &status, 0);
+	return 0;
+}
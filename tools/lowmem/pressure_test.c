@@ -0,0 +1,200 @@
+/*
+ * pressure_test: drive memory pressure and check the lowmem_pressure events
+ *
+ * The test protects itself from the lowmemorykiller, then maps and touches
+ * anonymous memory a step at a time, reading /dev/lowmem_pressure after each
+ * step, until the level gets to critical or the limit is reached. Then it
+ * frees everything and waits for the level to go back to low. It passes if
+ * at least the medium level was reported while allocating and low was
+ * reported again after freeing.
+ *
+ * Run it as root on a test system: everything else on it is likely to be
+ * killed along the way.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Compile by:
+ *
+ * $(CROSS_COMPILE)gcc -Wall -O2 -o pressure_test pressure_test.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PRESSURE_DEV	"/dev/lowmem_pressure"
+#define MAX_CHUNKS	4096
+
+enum { LOW, MEDIUM, CRITICAL };
+static const char *level_names[] = { "low", "medium", "critical" };
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(2);
+}
+
+/* read one event, returns its level or -1 if there is none pending */
+static int read_level(int fd, unsigned int *pressure)
+{
+	char buf[64], name[16];
+	ssize_t len;
+	int i;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0) {
+		if (errno == EAGAIN)
+			return -1;
+		die("read " PRESSURE_DEV);
+	}
+	buf[len] = '\0';
+	if (sscanf(buf, "%15s %u", name, pressure) != 2)
+		goto bad;
+	for (i = 0; i <= CRITICAL; i++)
+		if (!strcmp(name, level_names[i]))
+			return i;
+bad:
+	fprintf(stderr, "pressure_test: bad event '%s'\n", buf);
+	exit(2);
+}
+
+static long mem_total_mb(void)
+{
+	FILE *f = fopen("/proc/meminfo", "r");
+	long kb = 0;
+
+	if (!f || fscanf(f, "MemTotal: %ld kB", &kb) != 1)
+		die("/proc/meminfo");
+	fclose(f);
+	return kb / 1024;
+}
+
+static void protect_self(void)
+{
+	FILE *f = fopen("/proc/self/oom_adj", "w");
+
+	if (!f || fprintf(f, "-17\n") < 0 || fclose(f)) {
+		fprintf(stderr, "pressure_test: cannot set oom_adj, "
+			"we may get killed ourselves\n");
+	}
+}
+
+static void usage(void)
+{
+	printf("pressure_test [-m max_mb] [-s step_mb] [-t timeout_s]\n"
+	       "  -m n  allocate at most n MiB (default MemTotal)\n"
+	       "  -s n  allocate n MiB per step (default 8)\n"
+	       "  -t n  wait n seconds for the level to drop (default 5)\n");
+}
+
+int main(int argc, char **argv)
+{
+	static void *chunks[MAX_CHUNKS];
+	long max_mb = mem_total_mb();
+	long step_mb = 8;
+	int timeout = 5;
+	int nr_chunks = 0;
+	int level, max_level, last;
+	unsigned int pressure = 0;
+	struct pollfd pfd;
+	size_t step;
+	int fd;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "m:s:t:h")) != -1) {
+		switch (c) {
+		case 'm':
+			max_mb = atol(optarg);
+			break;
+		case 's':
+			step_mb = atol(optarg);
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+			return c == 'h' ? 0 : 2;
+		}
+	}
+	if (max_mb < 1 || step_mb < 1 || timeout < 1) {
+		usage();
+		return 2;
+	}
+	step = (size_t)step_mb << 20;
+
+	protect_self();
+
+	fd = open(PRESSURE_DEV, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		die(PRESSURE_DEV);
+	last = read_level(fd, &pressure);
+	if (last < 0) {
+		fprintf(stderr, "pressure_test: no initial level\n");
+		return 2;
+	}
+	max_level = last;
+	printf("start: %s %u\n", level_names[last], pressure);
+
+	while (max_level < CRITICAL && nr_chunks < MAX_CHUNKS &&
+	       nr_chunks * step_mb < max_mb) {
+		void *p = mmap(NULL, step, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (p == MAP_FAILED) {
+			printf("mmap failed after %ld MiB\n",
+			       nr_chunks * step_mb);
+			break;
+		}
+		memset(p, 0x5a, step);
+		chunks[nr_chunks++] = p;
+
+		while ((level = read_level(fd, &pressure)) >= 0) {
+			printf("%6ld MiB: %s %u\n", nr_chunks * step_mb,
+			       level_names[level], pressure);
+			if (level > max_level)
+				max_level = level;
+			last = level;
+		}
+	}
+
+	for (i = 0; i < nr_chunks; i++)
+		munmap(chunks[i], step);
+	printf("freed %ld MiB\n", nr_chunks * step_mb);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (last != LOW) {
+		c = poll(&pfd, 1, timeout * 1000);
+		if (c < 0 && errno != EINTR)
+			die("poll");
+		if (c == 0)
+			break;
+		while ((level = read_level(fd, &pressure)) >= 0) {
+			printf("after free: %s %u\n", level_names[level],
+			       pressure);
+			last = level;
+		}
+	}
+
+	if (max_level < MEDIUM) {
+		printf("FAIL: pressure never got above low\n");
+		return 1;
+	}
+	if (last != LOW) {
+		printf("FAIL: still %s %d s after freeing\n",
+		       level_names[last], timeout);
+		return 1;
+	}
+	printf("PASS: got to %s, back to low after freeing\n",
+	       level_names[max_level]);
+	return 0;
+}